@@ -5,11 +5,15 @@
 //
 
 #include <iostream>
+#include <sstream>
 #include <string>
-#include <list>
-#include <stack>
+#include <vector>
 #include <stdexcept>
 #include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 using namespace std ;
 
 #include "Sally.h"
@@ -17,64 +21,383 @@ using namespace std ;
 
 // Basic Token constructor. Just assigns values.
 //
-Token::Token(TokenKind kind, int val, string txt) {
+Token::Token(TokenKind kind, cell_t val, int line) {
    m_kind = kind ;
    m_value = val ;
-   m_text = txt ;
+   m_line = line ;
+}
+
+
+// Empty pool with a small hash table.
+//
+StringPool::StringPool() {
+   m_table.assign(64, 0) ;
+}
+
+
+// FNV-1a hash of len chars at s.
+//
+unsigned StringPool::hash(const char *s, int len) {
+   unsigned h = 2166136261u ;
+
+   for (int i = 0 ; i < len ; i++) {
+      h = (h ^ (unsigned char) s[i]) * 16777619u ;
+   }
+   return h ;
+}
+
+
+// Returns the handle of the string of len chars at s,
+// adding the string to the pool if it is not there yet.
+//
+// The hash table uses linear probing and is kept at most
+// half full.
+//
+int StringPool::intern(const char *s, int len) {
+   unsigned mask = m_table.size() - 1 ;
+   unsigned i = hash(s, len) & mask ;
+
+   while (m_table[i] != 0) {
+      const string& str = m_strings[m_table[i] - 1] ;
+      if ( (int) str.size() == len && str.compare(0, len, s, len) == 0 ) {
+         return m_table[i] - 1 ;
+      }
+      i = (i + 1) & mask ;
+   }
+
+   int h = m_strings.size() ;
+   m_strings.push_back( string(s, len) ) ;
+   m_table[i] = h + 1 ;
+
+   if ( 2 * m_strings.size() > m_table.size() ) {
+      rehash() ;
+   }
+   return h ;
+}
+
+
+// Returns the handle of the string of len chars at s, or -1
+// if it is not in the pool.
+//
+int StringPool::find(const char *s, int len) const {
+   unsigned mask = m_table.size() - 1 ;
+   unsigned i = hash(s, len) & mask ;
+
+   while (m_table[i] != 0) {
+      const string& str = m_strings[m_table[i] - 1] ;
+      if ( (int) str.size() == len && str.compare(0, len, s, len) == 0 ) {
+         return m_table[i] - 1 ;
+      }
+      i = (i + 1) & mask ;
+   }
+   return -1 ;
+}
+
+
+// Double the hash table and put every handle back in.
+//
+void StringPool::rehash() {
+   m_table.assign(2 * m_table.size(), 0) ;
+   unsigned mask = m_table.size() - 1 ;
+
+   for (size_t h = 0 ; h < m_strings.size() ; h++) {
+      unsigned i = hash(m_strings[h].data(), m_strings[h].size()) & mask ;
+      while (m_table[i] != 0) {
+         i = (i + 1) & mask ;
+      }
+      m_table[i] = h + 1 ;
+   }
 }
 
 
 // Basic SymTabEntry constructor. Just assigns values.
 //
-SymTabEntry::SymTabEntry(TokenKind kind, int val, operation_t fptr) {
+SymTabEntry::SymTabEntry(TokenKind kind, int val, operation_t fptr,
+                         OpCode op) {
    m_kind = kind ;
    m_value = val ;
    m_dothis = fptr ;
+   m_opcode = op ;
+}
+
+
+// Basic Instr constructor. Just assigns values.
+//
+Instr::Instr(OpCode op, cell_t arg, int line) {
+   m_op = op ;
+   m_arg = arg ;
+   m_line = line ;
+#ifdef SALLY_THREADED
+   m_handler = NULL ;
+#endif
+}
+
+
+// Allocate the cells of a parameter stack.
+//
+ParamStack::ParamStack(int depth) {
+   m_base = new Cell[depth + 1] + 1 ;      // and the spare one
+   m_top = m_base ;
+   m_limit = m_base + depth ;
+}
+
+
+ParamStack::~ParamStack() {
+   delete [] (m_base - 1) ;
+}
+
+
+// Set up a sink that writes to os.
+//
+OutputSink::OutputSink(ostream& os, FlushPolicy policy, int size) :
+   m_os(os)
+{
+   m_policy = policy ;
+   m_size = (size > 64) ? size : 64 ;
+   m_buf = new char[m_size] ;
+   m_len = 0 ;
+}
+
+
+OutputSink::~OutputSink() {
+   flush() ;
+   delete [] m_buf ;
+}
+
+
+// Write out everything buffered so far.
+//
+void OutputSink::flush() {
+   if ( m_len > 0 ) {
+      m_os.write(m_buf, m_len) ;
+      m_len = 0 ;
+   }
+   m_os.flush() ;
+}
+
+
+// Make room for n more chars. When output is kept until the
+// end the buffer grows, otherwise it is written out.
+//
+void OutputSink::makeRoom(int n) {
+   if ( m_policy != FLUSH_AT_EXIT ) {
+      if ( m_len > 0 ) {
+         m_os.write(m_buf, m_len) ;
+         m_len = 0 ;
+      }
+      if ( n <= m_size ) return ;
+   }
+
+   int size = m_size ;
+   while ( size - m_len < n ) size *= 2 ;
+
+   char *buf = new char[size] ;
+   for (int i = 0 ; i < m_len ; i++) buf[i] = m_buf[i] ;
+   delete [] m_buf ;
+   m_buf = buf ;
+   m_size = size ;
+}
+
+
+void OutputSink::write(const char *s, int len) {
+   if ( m_size - m_len < len ) makeRoom(len) ;
+   for (int i = 0 ; i < len ; i++) m_buf[m_len + i] = s[i] ;
+   m_len += len ;
+}
+
+
+// Format v in base 10, right to left in a small buffer.
+//
+void OutputSink::writeInt(long long v) {
+   char digits[24] ;
+   char *p = digits + sizeof(digits) ;
+   unsigned long long u = (v < 0) ? 0 - (unsigned long long) v : v ;
+
+   do {
+      *--p = '0' + u % 10 ;
+      u /= 10 ;
+   } while (u != 0) ;
+
+   if (v < 0) *--p = '-' ;
+   write(p, digits + sizeof(digits) - p) ;
+}
+
+
+// End of a line. Line buffered sinks write it out now.
+//
+void OutputSink::newline() {
+   put('\n') ;
+   if ( m_policy == FLUSH_EACH_LINE ) flush() ;
+}
+
+
+// Default settings.
+//
+SallyOptions::SallyOptions() {
+   m_stackDepth = 65536 ;
+   m_returnDepth = 1024 ;
+   m_dataSpace = 1 << 24 ;
+   m_arraySpace = 1 << 24 ;
+   m_inlineLimit = 8 ;
+   m_optimize = true ;
+   m_fusionReport = false ;
+   m_profile = false ;
+   m_trace = 0 ;
+   m_imageCache = false ;
+   m_verify = true ;
+   m_jit = false ;
+   m_jitThreshold = 100 ;
+   m_flushPolicy = OutputSink::FLUSH_WHEN_FULL ;
+   m_outputBuffer = 64 * 1024 ;
 }
 
 
 // Constructor for Sally Forth interpreter.
 // Adds built-in functions to the symbol table.
 //
-Sally::Sally(istream& input_stream) :
-   istrm(input_stream)  // use member initializer to bind reference
+Sally::Sally(istream& input_stream, ostream& output_stream,
+             const SallyOptions& opts, ostream& error_stream) :
+   istrm(input_stream),  // use member initializer to bind reference
+   out(output_stream, opts.m_flushPolicy, opts.m_outputBuffer),
+   errs(error_stream),
+   tkNext(0),
+   inputDone(false),
+   lineNo(0),
+   params(opts.m_stackDepth),
+   arrayCells(0),
+   arrayLimit(opts.m_arraySpace),
+   dataLimit(opts.m_dataSpace),
+   dictThreaded(0),
+   dictHooks(-1),
+   rstack(opts.m_returnDepth),
+   inlineLimit(opts.m_inlineLimit),
+   optimizeOn(opts.m_optimize),
+   fusionReport(opts.m_fusionReport),
+   profileOn(opts.m_profile),
+   traceOn(opts.m_trace > 0),
+   trace(opts.m_trace),
+   imageCache(opts.m_imageCache),
+   sourceHash(0),
+   sourceSize(0),
+   codeReady(false),
+   verifyOn(opts.m_verify),
+   jitOn(opts.m_jit && !opts.m_profile && opts.m_trace <= 0),
+   jitThreshold(opts.m_jitThreshold),
+   jitCompiled(0),
+   jitDictLoops(0),
+   dictJitted(0)
 {
+   for (int f = 0 ; f < FUSE_COUNT ; f++) {
+      fusions[f] = 0 ;
+   }
 
-   symtab["DUMP"]    =  SymTabEntry(KEYWORD,0,&doDUMP) ;
 
-   symtab["+"]    =  SymTabEntry(KEYWORD,0,&doPlus) ;
-   symtab["-"]    =  SymTabEntry(KEYWORD,0,&doMinus) ;
-   symtab["*"]    =  SymTabEntry(KEYWORD,0,&doTimes) ;
-   symtab["/"]    =  SymTabEntry(KEYWORD,0,&doDivide) ;
-   symtab["%"]    =  SymTabEntry(KEYWORD,0,&doMod) ;
-   symtab["NEG"]  =  SymTabEntry(KEYWORD,0,&doNEG) ;
+   symtab["DUMP"]    =  SymTabEntry(KEYWORD,0,&doDUMP,OP_DUMP) ;
+
+   symtab["+"]    =  SymTabEntry(KEYWORD,0,NULL,OP_PLUS) ;
+   symtab["-"]    =  SymTabEntry(KEYWORD,0,NULL,OP_MINUS) ;
+   symtab["*"]    =  SymTabEntry(KEYWORD,0,NULL,OP_TIMES) ;
+   symtab["/"]    =  SymTabEntry(KEYWORD,0,NULL,OP_DIVIDE) ;
+   symtab["%"]    =  SymTabEntry(KEYWORD,0,NULL,OP_MOD) ;
+   symtab["NEG"]  =  SymTabEntry(KEYWORD,0,NULL,OP_NEG) ;
+
+   symtab["."]    =  SymTabEntry(KEYWORD,0,&doDot,OP_DOT) ;
+   symtab["SP"]   =  SymTabEntry(KEYWORD,0,&doSP,OP_SP) ;
+   symtab["CR"]   =  SymTabEntry(KEYWORD,0,&doCR,OP_CR) ;
+   symtab["DUP"]  =  SymTabEntry(KEYWORD,0,NULL,OP_DUP) ;
+   symtab["DROP"] =  SymTabEntry(KEYWORD,0,NULL,OP_DROP) ;
+   symtab["SWAP"] =  SymTabEntry(KEYWORD,0,NULL,OP_SWAP) ;
+   symtab["ROT"]  =  SymTabEntry(KEYWORD,0,NULL,OP_ROT) ;
+   symtab["SET"]  =  SymTabEntry(KEYWORD,0,&doSET,OP_SET) ;
+   symtab["@"]  =  SymTabEntry(KEYWORD,0,NULL,OP_AT) ;
+   symtab["!"]  =  SymTabEntry(KEYWORD,0,NULL,OP_STORE) ;
+   symtab["<"]  =  SymTabEntry(KEYWORD,0,NULL,OP_LT) ;
+   symtab["<="]  =  SymTabEntry(KEYWORD,0,NULL,OP_LE) ;
+   symtab["=="]  =  SymTabEntry(KEYWORD,0,NULL,OP_EQ) ;
+   symtab["!="]  =  SymTabEntry(KEYWORD,0,NULL,OP_NE) ;
+   symtab[">="]  =  SymTabEntry(KEYWORD,0,NULL,OP_GE) ;
+   symtab[">"]  =  SymTabEntry(KEYWORD,0,NULL,OP_GT) ;
+   symtab["AND"]  =  SymTabEntry(KEYWORD,0,NULL,OP_AND) ;
+   symtab["OR"]  =  SymTabEntry(KEYWORD,0,NULL,OP_OR) ;
+   symtab["NOT"]  =  SymTabEntry(KEYWORD,0,NULL,OP_NOT) ;
+
+   symtab["HERE"]  =  SymTabEntry(KEYWORD,0,&doHERE,OP_HERE) ;
+   symtab["ALLOT"]  =  SymTabEntry(KEYWORD,0,&doALLOT,OP_ALLOT) ;
+   symtab[","]  =  SymTabEntry(KEYWORD,0,&doCOMMA,OP_COMMA) ;
+   symtab["CREATE"]  =  SymTabEntry(KEYWORD,0,&doCREATE,OP_CREATE) ;
+   symtab["RESET"]  =  SymTabEntry(KEYWORD,0,&doRESET,OP_RESET) ;
+
+   // control flow is compiled, not called
+   //
+   symtab["IFTHEN"] = SymTabEntry(KEYWORD,0,NULL,OP_IFTHEN) ;
+   symtab["ELSE"]  =  SymTabEntry(KEYWORD,0,NULL,OP_ELSE) ;
+   symtab["ENDIF"]  =  SymTabEntry(KEYWORD,0,NULL,OP_ENDIF) ;
+   symtab["DO"]  =  SymTabEntry(KEYWORD,0,NULL,OP_DO) ;
+   symtab["UNTIL"]  =  SymTabEntry(KEYWORD,0,NULL,OP_UNTIL) ;
+   symtab[":"]  =  SymTabEntry(KEYWORD,0,NULL,OP_COLON) ;
+   symtab[";"]  =  SymTabEntry(KEYWORD,0,NULL,OP_SEMI) ;
+
+   arrayWords() ;
+
+
+   // opcode table for execute(), and the keywords by
+   // their pool handles for compile()
+   //
+   optab.assign(OP_COUNT, NULL) ;
+   map<string,SymTabEntry>::iterator it ;
+   for (it = symtab.begin() ; it != symtab.end() ; it++) {
+      optab[it->second.m_opcode] = it->second.m_dothis ;
+
+      int h = pool.intern(it->first) ;
+      keywords.resize(pool.size(), NULL) ;
+      keywords[h] = &it->second ;
+   }
 
-   symtab["."]    =  SymTabEntry(KEYWORD,0,&doDot) ;
-   symtab["SP"]   =  SymTabEntry(KEYWORD,0,&doSP) ;
-   symtab["CR"]   =  SymTabEntry(KEYWORD,0,&doCR) ;
-   symtab["DUP"]  =  SymTabEntry(KEYWORD,0,&doDUP) ;
-   symtab["DROP"] =  SymTabEntry(KEYWORD,0,&doDROP) ;
-   symtab["SWAP"] =  SymTabEntry(KEYWORD,0,&doSWAP) ;
-   symtab["ROT"]  =  SymTabEntry(KEYWORD,0,&doROT) ;
-   symtab["SET"]  =  SymTabEntry(KEYWORD,0,&doSET) ;
-   symtab["@"]  =  SymTabEntry(KEYWORD,0,&doAT) ;
-   symtab["!"]  =  SymTabEntry(KEYWORD,0,&doSTORE) ;
-   symtab["<"]  =  SymTabEntry(KEYWORD,0,&doLessThan) ;
-   symtab["<="]  =  SymTabEntry(KEYWORD,0,&doLessEqTo) ;
-   symtab["=="]  =  SymTabEntry(KEYWORD,0,&doEquiv) ;
-   symtab["!="]  =  SymTabEntry(KEYWORD,0,&doNotEq) ;
-   symtab[">="]  =  SymTabEntry(KEYWORD,0,&doGrtEqTo) ;
-   symtab[">"]  =  SymTabEntry(KEYWORD,0,&doGrtThan) ;
-   symtab["AND"]  =  SymTabEntry(KEYWORD,0,&doAND) ;
-   symtab["OR"]  =  SymTabEntry(KEYWORD,0,&doOR) ;
-   symtab["NOT"]  =  SymTabEntry(KEYWORD,0,&doNOT) ;
-   symtab["IFTHEN"] = SymTabEntry(KEYWORD,0,&doIFTHEN) ;
-   symtab["DO"]  =  SymTabEntry(KEYWORD,0,&DO) ;
-   symtab["ELSE"]  =  SymTabEntry(KEYWORD,0) ;
-   symtab["ENDIF"]  =  SymTabEntry(KEYWORD,0) ;
+}
+
+
+// Gives back the memory of loops compiled by the JIT.
+//
+Sally::~Sally() {
+   jitRelease(0) ;
+}
+
+
+// Is the token of len chars at s a base 10 number?
+// If so its value is put in n.
+//
+// Follows strtol(): an optional sign and at least one digit,
+// nothing else. Values too big for a cell are clamped to
+// CELL_MIN or CELL_MAX.
+//
+static bool isNumber(const char *s, int len, cell_t& n) {
+   int pos = 0 ;
+   bool neg = false ;
+   ucell_t val = 0 ;
+   ucell_t limit = CELL_MAX ;
+
+   if ( s[0] == '-' || s[0] == '+' ) {
+      neg = (s[0] == '-') ;
+      pos++ ;
+   }
+   if ( pos == len ) {
+      return false ;
+   }
+   if ( neg ) limit++ ;
 
+   for ( ; pos < len ; pos++) {
+      unsigned d = s[pos] - '0' ;
+      if (d > 9) return false ;
 
+      if ( val > (limit - d) / 10 ) {
+         val = limit ;
+      } else {
+         val = val * 10 + d ;
+      }
+   }
 
+   n = neg ? (cell_t) (0 - val) : (cell_t) val ;
+   return true ;
 }
 
 
@@ -96,8 +419,7 @@ bool Sally::fillBuffer() {
    string line ;     // single line of input
    int pos ;         // current position in the line
    int len ;         // # of char in current token
-   long int n ;      // int value of token
-   char *endPtr ;    // used with strtol()
+   cell_t n ;        // int value of token
 
 
    while(true) {    // keep reading until empty line read or eof
@@ -105,6 +427,7 @@ bool Sally::fillBuffer() {
       // get one line from standard in
       //
       getline(istrm, line) ;
+      lineNo++ ;
 
       // if "normal" empty line encountered, return to mainLoop
       //
@@ -151,13 +474,10 @@ bool Sally::fillBuffer() {
                len++ ;
             }
 
-            // make new string with characters from
-            // line[pos] to line[pos+len-1]
-            string literal(line,pos,len) ;  // copy from pos for len chars
-
-            // Add to token list
+            // Add characters line[pos] to line[pos+len-1]
+            // to the token list
             //
-            tkBuffer.push_back( Token(STRING,0,literal) ) ;
+            tkBuffer.push_back( Token(STRING,pool.intern(&line[pos],len),lineNo) ) ;
 
             // Different update if end reached or " found
             //
@@ -179,18 +499,14 @@ bool Sally::fillBuffer() {
                len++ ;
             }
 
-            string literal(line,pos,len) ;   // copy form pos for len chars
-            pos = pos + len ;
-
             // Try to convert to a number
             //
-            n = strtol(literal.c_str(), &endPtr, 10) ;
-
-            if (*endPtr == '\0') {
-               tkBuffer.push_back( Token(INTEGER,n,literal) ) ;
+            if ( isNumber(&line[pos], len, n) ) {
+               tkBuffer.push_back( Token(INTEGER,n,lineNo) ) ;
             } else {
-               tkBuffer.push_back( Token(UNKNOWN,0,literal) ) ;
+               tkBuffer.push_back( Token(UNKNOWN,pool.intern(&line[pos],len),lineNo) ) ;
             }
+            pos = pos + len ;
          }
 
          // skip over trailing spaces & tabs
@@ -211,655 +527,1206 @@ bool Sally::fillBuffer() {
 // Checks for end-of-file and throws exception
 //
 Token Sally::nextToken() {
-      Token tk ;
-      bool more = true ;
+      bool more = !inputDone ;
 
-      while(more && tkBuffer.empty() ) {
+      while(more && tkNext == tkBuffer.size() ) {
+         tkBuffer.clear() ;
+         tkNext = 0 ;
          more = fillBuffer() ;
       }
 
-      if ( !more && tkBuffer.empty() ) {
+      if ( tkNext == tkBuffer.size() ) {
          throw EOProgram("End of Program") ;
       }
 
-      tk = tkBuffer.front() ;
-      tkBuffer.pop_front() ;
-      return tk ;
+      return tkBuffer[tkNext++] ;
 }
-// The main interpreter loop of the Sally Forth interpreter.
-// It gets a token and either push the token onto the parameter
-// stack or looks for it in the symbol table.
+
+
+// Read the whole program from the file at path instead
+// of from the input stream.
 //
+// The file is mapped into memory and lexed in one pass
+// into tkBuffer, with the same rules as fillBuffer() except
+// that blank lines mean nothing. Names and string literals
+// are interned straight from the mapped bytes, so only the
+// first copy of each is ever copied. Returns false if the
+// file can not be read.
 //
-void Sally::mainLoop() {
+// With the image cache on, a good .sallyc image of the file
+// is loaded instead, see SallyImage.cpp.
+//
+bool Sally::loadFile(const char *path) {
+   struct stat st ;
+   int fd = open(path, O_RDONLY) ;
 
-   Token tk ;
-   map<string,SymTabEntry>::iterator it ;
+   if ( fd < 0 ) {
+      return false ;
+   }
+   if ( fstat(fd, &st) < 0 ) {
+      close(fd) ;
+      return false ;
+   }
 
-   try {
-      while( 1 ) {
-         tk = nextToken() ;
+   tkBuffer.clear() ;
+   tkNext = 0 ;
+   inputDone = true ;
 
-         if (tk.m_kind == INTEGER || tk.m_kind == STRING) {
+   if ( st.st_size == 0 ) {
+      close(fd) ;
+      return true ;
+   }
 
-            // if INTEGER or STRING just push onto stack
-            params.push(tk) ;
+   void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) ;
+   close(fd) ;
+   if ( map == MAP_FAILED ) {
+      return false ;
+   }
+   madvise(map, st.st_size, MADV_SEQUENTIAL) ;
 
-         } else {
-            it = symtab.find(tk.m_text) ;
+   if ( imageCache && findImage(path, (const char *) map, st.st_size) ) {
+      munmap(map, st.st_size) ;
+      return true ;
+   }
 
-            if ( it == symtab.end() )  {   // not in symtab
+   lex( (const char *) map, (const char *) map + st.st_size ) ;
 
-               params.push(tk) ;
+   munmap(map, st.st_size) ;
+   return true ;
+}
 
-            } else if (it->second.m_kind == KEYWORD)  {
 
-               // invoke the function for this operation
-               //
+// Add the tokens of the chars from p to end to tkBuffer, with
+// the rules of fillBuffer() except that blank lines mean
+// nothing. Lines are counted from 1 at p.
+//
+void Sally::lex(const char *p, const char *end) {
+   const char *tok ;
+   cell_t n ;
+   int line = 1 ;
 
-               it->second.m_dothis(this) ;
+   tkBuffer.reserve( tkBuffer.size() + (end - p) / 4 ) ;
 
-            } else if (it->second.m_kind == VARIABLE) {
+   while (p < end) {
 
-               // variables are pushed as tokens
-               //
-               tk.m_kind = VARIABLE ;
-               params.push(tk) ;
+      // white space
+      //
+      if ( *p == ' ' || *p == '\t' || *p == '\n' || *p == '\r' ) {
+         if ( *p == '\n' ) line++ ;
+         p++ ;
+         continue ;
+      }
 
-            } else {
+      // comment: skip rest of line
+      //
+      if ( *p == '/' && p + 1 < end && p[1] == '/' ) {
+         while (p < end && *p != '\n') p++ ;
+         continue ;
+      }
 
-               // default action
-               //
-               params.push(tk) ;
+      // string literal, up to " or end of line
+      //
+      if ( *p == '.' && p + 1 < end && p[1] == '"' ) {
+         p += 2 ;
+         tok = p ;
+         while (p < end && *p != '"' && *p != '\n') p++ ;
+         tkBuffer.push_back( Token(STRING, pool.intern(tok, p - tok), line) ) ;
+         if (p < end && *p == '"') p++ ;
+         continue ;
+      }
 
-            }
-         }
+      // "normal" token
+      //
+      tok = p ;
+      while (p < end && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r') {
+         p++ ;
       }
 
+      if ( isNumber(tok, p - tok, n) ) {
+         tkBuffer.push_back( Token(INTEGER, n, line) ) ;
+      } else {
+         tkBuffer.push_back( Token(UNKNOWN, pool.intern(tok, p - tok), line) ) ;
+      }
+   }
+}
+
+
+// The main interpreter loop of the Sally Forth interpreter.
+// It compiles the program one unit at a time and runs
+// each unit's code.
+//
+//
+void Sally::mainLoop() {
+
+   try {
+      while( 1 ) {
+         if ( codeReady ) {
+            codeReady = false ;
+         } else {
+            compile() ;
+         }
+         if ( !imagePath.empty() ) {
+            saveImage() ;
+         }
+         execute() ;
+      }
    } catch (EOProgram& e) {
 
-      cerr << "End of Program\n" ;
+      out.flush() ;
+      errs << "End of Program\n" ;
       if ( params.size() == 0 ) {
-         cerr << "Parameter stack empty.\n" ;
+         errs << "Parameter stack empty.\n" ;
       } else {
-         cerr << "Parameter stack has " << params.size() << " token(s).\n" ;
+         errs << "Parameter stack has " << params.size() << " token(s).\n" ;
       }
 
-   } catch (out_of_range& e) {
-
-      cerr << "Parameter stack underflow??\n" ;
-
    } catch (...) {
 
-      cerr << "Unexpected exception caught\n" ;
+      // program output goes out before any messages
+      //
+      out.flush() ;
+      reportError(errs) ;
+   }
 
+   if ( fusionReport ) {
+      reportFusions(errs) ;
+   }
+   if ( profileOn ) {
+      dump(errs) ;
    }
 }
 
 
-void Sally::doPlus(Sally *Sptr) {
-   Token p1, p2 ;
+// Print what went wrong to os, and the trace if there is
+// one. Only to be called while an exception is being
+// handled; it is thrown again to see what it was.
+//
+void Sally::reportError(ostream& os) {
 
-   if ( Sptr->params.size() < 2 ) {
-      throw out_of_range("Need two parameters for +.") ;
-   }
-   p1 = Sptr->params.top() ;
-   Sptr->params.pop() ;
-   p2 = Sptr->params.top() ;
-   Sptr->params.pop() ;
-   int answer = p2.m_value + p1.m_value ;
-   Sptr->params.push( Token(INTEGER, answer, "") ) ;
-}
+   try {
+      throw ;
 
+   } catch (EOProgram& e) {
+
+      os << "Compile error: program ends too soon\n" ;
+      return ;
+
+   } catch (CompileError& e) {
+
+      os << "Compile error: " << e.what() << "\n" ;
+      return ;
+
+   } catch (out_of_range& e) {
+
+      os << "Parameter stack underflow??\n" ;
+
+   } catch (overflow_error& e) {
+
+      os << e.what() << "\n" ;
+
+   } catch (const char *msg) {
+
+      os << msg << "\n" ;
+
+   } catch (...) {
 
-void Sally::doMinus(Sally *Sptr) {
-   Token p1, p2 ;
+      os << "Unexpected exception caught\n" ;
 
-   if ( Sptr->params.size() < 2 ) {
-      throw out_of_range("Need two parameters for -.") ;
    }
-   p1 = Sptr->params.top() ;
-   Sptr->params.pop() ;
-   p2 = Sptr->params.top() ;
-   Sptr->params.pop() ;
-   int answer = p2.m_value - p1.m_value ;
-   Sptr->params.push( Token(INTEGER, answer, "") ) ;
+
+   if ( traceOn ) {
+      reportTrace(os) ;
+   }
 }
 
 
-void Sally::doTimes(Sally *Sptr) {
-   Token p1, p2 ;
+// Compile and run a chunk of source on this interpreter,
+// one unit at a time. An error stops the chunk; the rest of
+// it is dropped and the message kept for lastError().
+//
+bool Sally::eval(const string& source) {
+
+   tkBuffer.clear() ;
+   tkNext = 0 ;
+   inputDone = true ;
+   lex( source.data(), source.data() + source.size() ) ;
 
-   if ( Sptr->params.size() < 2 ) {
-      throw out_of_range("Need two parameters for *.") ;
+   errorText.clear() ;
+   try {
+      while ( tkNext < tkBuffer.size() ) {
+         compile() ;
+         execute() ;
+      }
+   } catch (...) {
+      ostringstream msg ;
+
+      reportError(msg) ;
+      errorText = msg.str() ;
    }
-   p1 = Sptr->params.top() ;
-   Sptr->params.pop() ;
-   p2 = Sptr->params.top() ;
-   Sptr->params.pop() ;
-   int answer = p2.m_value * p1.m_value ;
-   Sptr->params.push( Token(INTEGER, answer, "") ) ;
+
+   out.flush() ;
+   tkBuffer.clear() ;
+   tkNext = 0 ;
+   return errorText.empty() ;
 }
 
-void Sally::doDivide(Sally *Sptr) {
-   Token p1, p2 ;
 
-   if ( Sptr->params.size() < 2 ) {
-      throw out_of_range("Need two parameters for /.") ;
+// The i-th cell from the top of the stack.
+//
+Cell Sally::stackCell(int i) {
+   if ( i < 0 || i >= params.size() ) {
+      throw out_of_range("no such stack cell") ;
    }
-   p1 = Sptr->params.top() ;
-   Sptr->params.pop() ;
-   p2 = Sptr->params.top() ;
-   Sptr->params.pop() ;
-   int answer = p2.m_value / p1.m_value ;
-   Sptr->params.push( Token(INTEGER, answer, "") ) ;
+   return params.peek(i) ;
 }
 
 
-void Sally::doMod(Sally *Sptr) {
-   Token p1, p2 ;
-
-   if ( Sptr->params.size() < 2 ) {
-      throw out_of_range("Need two parameters for %.") ;
+// What . would print for c.
+//
+string Sally::cellText(const Cell& c) {
+   ostringstream os ;
+
+   if ( c.m_kind == INTEGER ) {
+      os << c.m_value ;
+   } else if ( c.m_kind == STRING ) {
+      os << pool[c.m_value] ;
+   } else if ( c.m_kind == ARRAY ) {
+      const vector<cell_t>& a = arrayOf(c) ;
+
+      os << "[" ;
+      for (size_t i = 0 ; i < a.size() ; i++) {
+         os << (i > 0 ? " " : "") << a[i] ;
+      }
+      os << "]" ;
+   } else {
+      os << pool[varNames[c.m_value]] ;
    }
-   p1 = Sptr->params.top() ;
-   Sptr->params.pop() ;
-   p2 = Sptr->params.top() ;
-   Sptr->params.pop() ;
-   int answer = p2.m_value % p1.m_value ;
-   Sptr->params.push( Token(INTEGER, answer, "") ) ;
+   return os.str() ;
 }
 
 
-void Sally::doNEG(Sally *Sptr) {
-   Token p ;
+// Value of the variable called name, if it has been SET.
+//
+bool Sally::variable(const string& name, cell_t& value) {
+   int h = pool.find(name) ;
 
-   if ( Sptr->params.size() < 1 ) {
-      throw out_of_range("Need one parameter for NEG.") ;
+   if ( h < 0 || h >= (int) varSlots.size() || varSlots[h] < 0
+        || !varIsSet[varSlots[h]] ) {
+      return false ;
    }
-   p = Sptr->params.top() ;
-   Sptr->params.pop() ;
-   Sptr->params.push( Token(INTEGER, -p.m_value, "") ) ;
+   value = vars[varSlots[h]] ;
+   return true ;
 }
 
 
-void Sally::doDot(Sally *Sptr) {
+// Compile the next unit of the program into code.
+//
+// A unit is whatever fillBuffer() put in tkBuffer, extended
+// until every IFTHEN, DO and : in it has been closed, so that
+// branches never leave the unit.
+//
+// Keywords are looked up once here; everything that is
+// not a keyword compiles to a push. Control flow is resolved
+// here as well: DO and ENDIF emit no code, UNTIL jumps
+// straight back to the first instruction of the loop body,
+// IFTHEN jumps past its ELSE (or to its ENDIF) when false and
+// ELSE jumps to the ENDIF. Branch offsets are relative to the
+// branch, so code can be moved without patching.
+//
+// Colon definitions are compiled in place and then moved to
+// dict when the ; is reached.
+//
+void Sally::compile() {
+   Token tk ;
+   SymTabEntry *entry ;
+   vector<Instr> open ;   // IFTHEN, DO and : not yet closed,
+                          // and where their code starts
+   int label = 0 ;        // last place a branch jumps to. no
+                          // fusing with instructions before it
+   int defName = -1 ;     // handle of the name being defined
+   int pos ;
+
+   code.clear() ;
+
+   do {
+      try {
+         tk = nextToken() ;
+      } catch (EOProgram& e) {
+         if ( open.empty() ) throw ;
+         if ( open.back().m_op == OP_DO ) throw CompileError("DO without UNTIL") ;
+         if ( open.back().m_op == OP_COLON ) throw CompileError(": without ;") ;
+         throw CompileError("IFTHEN without ENDIF") ;
+      }
 
-   Token p ;
-   if ( Sptr->params.size() < 1 ) {
-      throw out_of_range("Need one parameter for .") ;
-   }
+      if (tk.m_kind == INTEGER) {
+         code.push_back( Instr(OP_INT, tk.m_value, tk.m_line) ) ;
+         continue ;
+      }
 
-   p = Sptr->params.top() ;
-   Sptr->params.pop() ;
+      if (tk.m_kind == STRING) {
+         code.push_back( Instr(OP_STR, tk.m_value, tk.m_line) ) ;
+         continue ;
+      }
 
-   if (p.m_kind == INTEGER) {
-      cout << p.m_value ;
-   } else {
-      cout << p.m_text ;
-   }
-}
+      entry = keyword(tk.m_value) ;
 
-void Sally::doSP(Sally *Sptr) {
-   cout << " " ;
-}
+      if ( entry == NULL ) {
+         code.push_back( Instr(OP_NAME, varSlot(tk.m_value), tk.m_line) ) ;
+         continue ;
+      }
 
+      OpCode op = entry->m_opcode ;
 
-void Sally::doCR(Sally *Sptr) {
-   cout << endl ;
-}
+      // name followed by @ ! or SET: use the slot directly
+      //
+      if ( (int) code.size() > label && code.back().m_op == OP_NAME ) {
+         if (op == OP_AT) {
+            code.back().m_op = OP_VARAT ;
+            continue ;
+         } else if (op == OP_STORE) {
+            code.back().m_op = OP_VARSTORE ;
+            continue ;
+         } else if (op == OP_SET) {
+            code.back().m_op = OP_VARSET ;
+            continue ;
+         }
+      }
 
-void Sally::doDUMP(Sally *Sptr) {
-   // do whatever for debugging
-}
+      switch (op) {
 
-void Sally::doDUP(Sally *Sptr) {
-  Token p;
+      case OP_DO:
+         label = code.size() ;
+         open.push_back( Instr(OP_DO, label) ) ;
+         break ;
 
-  if ( Sptr->params.size() < 1 ){
-    throw out_of_range("Need one parameter for DUP");
-  }
-  p = Sptr->params.top();
-  Sptr->params.push( Token(INTEGER, p.m_value, "") ) ;
-}
+      case OP_UNTIL:
+         if ( open.empty() || open.back().m_op != OP_DO ) {
+            throw CompileError("UNTIL without DO") ;
+         }
+         code.push_back( Instr(OP_UNTIL, open.back().m_arg - code.size(), tk.m_line) ) ;
+         open.pop_back() ;
+         break ;
+
+      case OP_IFTHEN:
+         open.push_back( Instr(OP_IFTHEN, code.size()) ) ;
+         code.push_back( Instr(op, 0, tk.m_line) ) ;
+         break ;
+
+      case OP_ELSE:
+         if ( open.empty() || open.back().m_op != OP_IFTHEN ) {
+            throw CompileError("ELSE without IFTHEN") ;
+         }
+         label = code.size() + 1 ;
+         pos = open.back().m_arg ;
+         code[pos].m_arg = label - pos ;
+         open.back() = Instr(OP_ELSE, code.size()) ;
+         code.push_back( Instr(op, 0, tk.m_line) ) ;
+         break ;
+
+      case OP_ENDIF:
+         if ( open.empty() || (open.back().m_op != OP_IFTHEN &&
+                               open.back().m_op != OP_ELSE) ) {
+            throw CompileError("ENDIF without IFTHEN") ;
+         }
+         label = code.size() ;
+         pos = open.back().m_arg ;
+         code[pos].m_arg = label - pos ;
+         open.pop_back() ;
+         break ;
+
+      case OP_COLON:
+         if ( defName >= 0 ) {
+            throw CompileError("definitions can not be nested") ;
+         }
+         tk = nextToken() ;
+         if ( tk.m_kind != UNKNOWN || (keyword(tk.m_value) != NULL &&
+                                       keyword(tk.m_value)->m_opcode != OP_CALL) ) {
+            throw CompileError(": needs a new name") ;
+         }
+         defName = tk.m_value ;
+         label = code.size() ;
+         open.push_back( Instr(OP_COLON, label) ) ;
+         break ;
+
+      case OP_SEMI:
+         if ( open.empty() || open.back().m_op != OP_COLON ) {
+            throw CompileError("; without :") ;
+         }
+         define(defName, open.back().m_arg) ;
+         defName = -1 ;
+         label = code.size() ;
+         open.pop_back() ;
+         break ;
 
-void Sally::doDROP(Sally *Sptr) {
-  if ( Sptr->params.size() < 1 ){
-     throw out_of_range("Need one parameter for DROP");
-  }
-  Sptr->params.pop();
-}
+      case OP_CALL:
+         if ( dictLength(entry->m_value) <= inlineLimit ) {
 
-void Sally::doSWAP(Sally *Sptr) {
-  Token p1;
-  Token p2;
-  Token temp;
+            // small definition: copy its body here
+            //
+            pos = code.size() ;
+            code.insert( code.end(), dict.begin() + entry->m_value,
+                         dict.begin() + entry->m_value + dictLength(entry->m_value) ) ;
+            label = code.size() ;
 
-  if ( Sptr->params.size() < 2 ){
-     throw out_of_range("Need two parameters for SWAP");
-  }
-  p1 = Sptr->params.top();
-  Sptr->params.pop();
-  p2 = Sptr->params.top();
-  Sptr->params.pop();
+            // the copy's loops are new ones to the JIT
+            //
+            for ( ; pos < (int) code.size() ; pos++) {
+               if ( code[pos].m_op == OP_JITUNTIL ) {
+                  code[pos] = Instr(OP_UNTIL, jitLoops[code[pos].m_arg].m_offset,
+                                    code[pos].m_line) ;
+               }
+            }
+         } else {
+            code.push_back( Instr(OP_CALL, entry->m_value, tk.m_line) ) ;
+         }
+         break ;
 
-  Sptr->params.push( Token(INTEGER, p1.m_value, "") ) ;
-  Sptr->params.push( Token(INTEGER, p2.m_value, "") ) ;
+      default:
+         code.push_back( Instr(op, 0, tk.m_line) ) ;
+         break ;
+      }
+
+   } while ( !open.empty() || tkNext < tkBuffer.size() ) ;
 
+   if ( optimizeOn ) {
+      fold(code) ;
+      optimize(code) ;
+   }
+   code.push_back( Instr(OP_HALT, 0, tk.m_line) ) ;
 }
 
-void Sally::doROT(Sally *Sptr){
-  Token p1;
-  Token p2;
-  Token p3;
 
- if ( Sptr->params.size() < 3 ){
-     throw out_of_range("Need three parameters for ROT");
- }
- p1 = Sptr->params.top();
- Sptr->params.pop();
- p2 = Sptr->params.top();
- Sptr->params.pop();
- p3 = Sptr->params.top();
- Sptr->params.pop();
+// Move the body of a colon definition, code[start] to the
+// end of code, into dict and enter its name in the symbol
+// table. A name that is defined again refers to the new body
+// from now on.
+//
+void Sally::define(int name, int start) {
+   int where = dict.size() ;
+   vector<Instr> body( code.begin() + start, code.end() ) ;
+
+   code.erase( code.begin() + start, code.end() ) ;
+   if ( optimizeOn ) {
+      fold(body) ;
+      optimize(body) ;
+   }
+   dict.insert( dict.end(), body.begin(), body.end() ) ;
+   dict.push_back( Instr(OP_EXIT, 0, body.empty() ? 0 : body.back().m_line) ) ;
 
- Sptr->params.push( Token(INTEGER, p2.m_value, "") ) ;
- Sptr->params.push( Token(INTEGER, p1.m_value, "") ) ;
- Sptr->params.push( Token(INTEGER, p3.m_value, "") ) ;
+   enterDefinition(name, where) ;
 }
 
-void Sally::doSET(Sally *Sptr){
-  Token var;
-  Token val;
 
-  if ( Sptr->params.size() < 2 ){
-     throw out_of_range("Need two parameters for SET");
-  }
-  var = Sptr->params.top();
-  Sptr->params.pop();
-  val = Sptr->params.top();
-  Sptr->params.pop();
+// Make the name with pool handle name a keyword that calls
+// the body at dict[where].
+//
+void Sally::enterDefinition(int name, int where) {
+   SymTabEntry& entry = symtab[pool[name]] ;
+   entry = SymTabEntry(KEYWORD, where, NULL, OP_CALL) ;
 
+   if ( name >= (int) keywords.size() ) {
+      keywords.resize(name + 1, NULL) ;
+   }
+   keywords[name] = &entry ;
+}
 
-  map<string, SymTabEntry>::iterator it;
 
-  it = Sptr->symtab.find(var.m_text);
-  //if the element does not exist within the map, set the variables value
-  if(it == Sptr->symtab.end()){
-    Sptr->symtab[var.m_text] = SymTabEntry(VARIABLE, val.m_value);
-  }
-  else
-    throw ("Error! Variable already set to a value.");
+// Number of instructions in the body of the definition
+// that starts at dict[start], not counting its EXIT.
+//
+int Sally::dictLength(int start) {
+   int end = start ;
+
+   while ( dict[end].m_op != OP_EXIT ) {
+      end++ ;
+   }
+   return end - start ;
 }
 
-void Sally::doAT(Sally *Sptr){
 
-  Token var;
-  var = Sptr->params.top();
-  Sptr->params.pop();
+// Returns the symbol table entry of the keyword whose
+// name has pool handle h, or NULL.
+//
+SymTabEntry *Sally::keyword(int h) {
+   if ( h < (int) keywords.size() ) {
+      return keywords[h] ;
+   }
+   return NULL ;
+}
 
-  map<string, SymTabEntry>::iterator it;
 
-  it = Sptr->symtab.find(var.m_text);
-  //if the variable exists, push its value onto the stack
-  if(it != Sptr->symtab.end()){
-    Sptr->params.push(Token (INTEGER, Sptr->symtab[var.m_text].m_value  , ""));
-  }
+// Returns the slot number of the variable whose name has
+// pool handle h. New names get the next free slot.
+//
+int Sally::varSlot(int h) {
 
-  else
-    throw ("Error! Variable does not exist.");
+   if ( h >= (int) varSlots.size() ) {
+      varSlots.resize(h + 1, -1) ;
+   }
+
+   if ( varSlots[h] < 0 ) {
+      varSlots[h] = varNames.size() ;
+      varNames.push_back(h) ;
+      vars.push_back(0) ;
+      varIsSet.push_back(0) ;
+   }
+   return varSlots[h] ;
 }
-void Sally::doSTORE(Sally *Sptr){
 
-  Token var;
-  Token val;
 
-  var = Sptr->params.top();
-  Sptr->params.pop();
-  val = Sptr->params.top();
-  Sptr->params.pop();
+// Instruction dispatch for execute().
+//
+// With SALLY_THREADED every instruction holds the address of
+// its handler and each handler jumps straight to the next one.
+// Otherwise the handlers are the cases of a switch.
+//
+// HOOK sees every instruction before it runs, to trace and
+// profile it when the instance of run() asks for that.
+//
+#define HOOK(in)   if (HOOKS & HOOK_TRACE) trace.record(in, DEPTH) ; \
+                   if (HOOKS & HOOK_PROFILE) { SYNC ; profile(in) ; }
+
+#ifdef SALLY_THREADED
+#define CASE(op)   L_##op:
+#define NEXT       in = ip++ ; HOOK(in) ; goto *in->m_handler
+#else
+#define CASE(op)   case op:
+#define NEXT       break
+#endif
+
+
+// The stack while code runs. The top cell is kept in tos
+// and sp is one past it; the array holds the cells below
+// the top, and sp[-1] is out of date. Only the handlers
+// see this. SYNC stores tos and sp back in params before
+// anything else looks at the stack (builtins, profile(),
+// the JIT, error reports); RELOAD picks them up again.
+//
+#define DEPTH         (sp - base)
+#define SYNC          sp[-1] = tos ; params.setEnd(sp)
+#define RELOAD        sp = params.end() ; tos = sp[-1]
+#define FAIL(e)       do { SYNC ; throw e ; } while (0)
 
-  map<string, SymTabEntry>::iterator it;
 
-  it = Sptr->symtab.find(var.m_text);
-  //if the variable exists, store the value into the variable
-  if(it != Sptr->symtab.end()){
-    Sptr->symtab[var.m_text] = SymTabEntry(INTEGER, val.m_value);
-  }
+// Parameter checks and stack ops shared by the inline
+// handlers. Code that can't underflow skips the checks;
+// pushes always look for overflow. BINARY and UNARY do a
+// word of cellOp(); one that fails leaves its operands on
+// the stack.
+//
+#define NEED(n, msg)  if ( !(HOOKS & HOOK_UNCHECKED) && DEPTH < (n) ) \
+                         FAIL(out_of_range(msg))
+#define PUSH(cell)    if ( sp == limit ) FAIL(overflow_error("Parameter stack overflow")) ; \
+                      sp[-1] = tos ; sp++ ; tos = (cell)
+#define DROP1         sp-- ; tos = sp[-1]
+#define POPVAL(v)     v = tos.m_value ; DROP1
+#define RESULT(v)     PUSH( Cell(INTEGER, (v)) )
+#define BINARY(op)    b = tos.m_value ; a = sp[-2].m_value ; \
+                      if ( !cellOp<op>(a, b, r) ) FAIL(cellOpError(op, b)) ; \
+                      sp-- ; tos = Cell(INTEGER, r)
+#define UNARY(op, x, y)  if ( !cellOp<op>(x, y, r) ) FAIL(cellOpError(op, y)) ; \
+                         tos = Cell(INTEGER, r)
+#define BRANCHIF(op, msg)  NEED(2, msg) ; b = tos.m_value ; a = sp[-2].m_value ; \
+                           sp -= 2 ; tos = sp[-1] ; \
+                           cellOp<op>(a, b, r) ; \
+                           if ( !r ) ip = in + in->m_arg
+
+
+// Run the code of the current program unit.
+//
+void Sally::execute() {
+   int hooks = (profileOn ? HOOK_PROFILE : 0) | (traceOn ? HOOK_TRACE : 0) ;
+
+   // checked all the same when profiling or tracing; those
+   // are for finding out what went wrong
+   //
+   if ( verifyOn && verify() && hooks == 0 ) {
+      hooks = HOOK_UNCHECKED ;
+   }
+   if ( jitOn ) jitPrepare() ;
+
+   switch ( hooks ) {
+   case 0:
+      run<0>() ;
+      break ;
+   case HOOK_UNCHECKED:
+      run<HOOK_UNCHECKED>() ;
+      break ;
+   case HOOK_PROFILE:
+      run<HOOK_PROFILE>() ;
+      break ;
+   case HOOK_TRACE:
+      run<HOOK_TRACE>() ;
+      break ;
+   default:
+      run<HOOK_PROFILE | HOOK_TRACE>() ;
+      break ;
+   }
 }
 
-void Sally::doGrtThan(Sally *Sptr){
 
-  if ( Sptr->params.size() < 2 ){
-    throw out_of_range("Need two parameters for >");
-  }
-  Token p1;
-  Token p2;
+// Pushes, control flow and the core words are handled inline;
+// the remaining opcodes call their builtin through optab.
+//
+// The code is threaded with the handlers of the instance
+// that runs it. So are the colon definitions, again whenever
+// another instance runs.
+//
+template <int HOOKS>
+void Sally::run() {
+   const Instr *ip = &code[0] ;
+   const Instr *in ;
+   const Instr **rp = &rstack[0] ;      // return stack
+   const Instr **rlimit = rp + rstack.size() ;
+   Cell * const base = params.base() ;  // parameter stack
+   Cell * const limit = params.limit() ;
+   Cell *sp ;
+   Cell tos ;
+   cell_t a, b, r ;
+   int c ;
+   Cell t ;
+
+   RELOAD ;
+
+#ifdef SALLY_THREADED
+   const void *labels[OP_COUNT] ;
+
+   for (int i = 0 ; i < OP_COUNT ; i++) {
+      labels[i] = &&L_CALL ;
+   }
+   labels[OP_NOP]    = &&L_OP_NOP ;
+   labels[OP_HALT]   = &&L_OP_HALT ;
+   labels[OP_INT]    = &&L_OP_INT ;
+   labels[OP_STR]    = &&L_OP_STR ;
+   labels[OP_NAME]   = &&L_OP_NAME ;
+   labels[OP_IFTHEN] = &&L_OP_IFTHEN ;
+   labels[OP_ELSE]   = &&L_OP_ELSE ;
+   labels[OP_UNTIL]  = &&L_OP_UNTIL ;
+   labels[OP_JITUNTIL] = &&L_OP_JITUNTIL ;
+   labels[OP_PLUS]   = &&L_OP_PLUS ;
+   labels[OP_MINUS]  = &&L_OP_MINUS ;
+   labels[OP_TIMES]  = &&L_OP_TIMES ;
+   labels[OP_DIVIDE] = &&L_OP_DIVIDE ;
+   labels[OP_MOD]    = &&L_OP_MOD ;
+   labels[OP_NEG]    = &&L_OP_NEG ;
+   labels[OP_DUP]    = &&L_OP_DUP ;
+   labels[OP_DROP]   = &&L_OP_DROP ;
+   labels[OP_SWAP]   = &&L_OP_SWAP ;
+   labels[OP_ROT]    = &&L_OP_ROT ;
+   labels[OP_AT]     = &&L_OP_AT ;
+   labels[OP_STORE]  = &&L_OP_STORE ;
+   labels[OP_LT]     = &&L_OP_LT ;
+   labels[OP_LE]     = &&L_OP_LE ;
+   labels[OP_EQ]     = &&L_OP_EQ ;
+   labels[OP_NE]     = &&L_OP_NE ;
+   labels[OP_GE]     = &&L_OP_GE ;
+   labels[OP_GT]     = &&L_OP_GT ;
+   labels[OP_AND]    = &&L_OP_AND ;
+   labels[OP_OR]     = &&L_OP_OR ;
+   labels[OP_NOT]    = &&L_OP_NOT ;
+   labels[OP_VARAT]    = &&L_OP_VARAT ;
+   labels[OP_VARSTORE] = &&L_OP_VARSTORE ;
+   labels[OP_VARSET]   = &&L_OP_VARSET ;
+   labels[OP_CALL]   = &&L_OP_CALL ;
+   labels[OP_EXIT]   = &&L_OP_EXIT ;
+   labels[OP_ADDI]   = &&L_OP_ADDI ;
+   labels[OP_SQUARE] = &&L_OP_SQUARE ;
+   labels[OP_NIP]    = &&L_OP_NIP ;
+   labels[OP_VARADD] = &&L_OP_VARADD ;
+   labels[OP_IFLT]   = &&L_OP_IFLT ;
+   labels[OP_IFLE]   = &&L_OP_IFLE ;
+   labels[OP_IFEQ]   = &&L_OP_IFEQ ;
+   labels[OP_IFNE]   = &&L_OP_IFNE ;
+   labels[OP_IFGE]   = &&L_OP_IFGE ;
+   labels[OP_IFGT]   = &&L_OP_IFGT ;
+
+   // thread the code, and any definitions added
+   // since the last time
+   //
+   if ( dictHooks != HOOKS ) {
+      dictThreaded = 0 ;
+      dictHooks = HOOKS ;
+   }
+   for (size_t i = 0 ; i < code.size() ; i++) {
+      code[i].m_handler = labels[code[i].m_op] ;
+   }
+   for ( ; dictThreaded < dict.size() ; dictThreaded++) {
+      dict[dictThreaded].m_handler = labels[dict[dictThreaded].m_op] ;
+   }
 
-  p2 = Sptr->params.top();
-  Sptr->params.pop();
-  p1 = Sptr->params.top();
-  Sptr->params.pop();
+   if (HOOKS & HOOK_PROFILE) profileStart() ;
+   NEXT ;
+#else
+   if (HOOKS & HOOK_PROFILE) profileStart() ;
+   while (1) {
+      in = ip++ ;
+      HOOK(in) ;
+      switch (in->m_op) {
+#endif
+
+   CASE(OP_HALT)
+      SYNC ;
+      return ;
+
+   CASE(OP_NOP)
+      NEXT ;
+
+   CASE(OP_INT)
+      PUSH( Cell(INTEGER, in->m_arg) ) ;
+      NEXT ;
+
+   CASE(OP_STR)
+      PUSH( Cell(STRING, in->m_arg) ) ;
+      NEXT ;
+
+   CASE(OP_NAME)
+      PUSH( Cell(VARIABLE, in->m_arg) ) ;
+      NEXT ;
+
+   CASE(OP_IFTHEN)
+      NEED(1, "Need one parameter for IFTHEN") ;
+      POPVAL(a) ;
+
+      // false: continue after the matching ELSE
+      if (a != 1) {
+         ip = in + in->m_arg ;
+      }
+      NEXT ;
 
-  //if p1 is greater than p2, return true. Else, false
-  if(p1.m_value > p2.m_value)
-    Sptr->params.push(Token (INTEGER, 1, ""));
-  else
-    Sptr->params.push(Token (INTEGER, 0, ""));
+   CASE(OP_ELSE)
+      // end of the true branch, skip the false one
+      ip = in + in->m_arg ;
+      NEXT ;
 
-}
+   CASE(OP_UNTIL)
+      NEED(1, "Need one parameter for UNTIL") ;
+      POPVAL(a) ;
 
-void Sally::doGrtEqTo(Sally *Sptr){
+      // condition not met: run the loop body again
+      if (a != 1) {
+         ip = in + in->m_arg ;
+      }
+      NEXT ;
 
-   if ( Sptr->params.size() < 2 ){
-    throw out_of_range("Need two parameters for >");
-  }
-  Token p1;
-  Token p2;
+   CASE(OP_JITUNTIL)
+      NEED(1, "Need one parameter for UNTIL") ;
+      POPVAL(a) ;
 
-  p2 = Sptr->params.top();
-  Sptr->params.pop();
-  p1 = Sptr->params.top();
-  Sptr->params.pop();
+      // round again, counted or in native code
+      if (a != 1) {
+         SYNC ;
+         ip = jitLoop(in) ;
+         RELOAD ;
+      }
+      NEXT ;
+
+   CASE(OP_PLUS)
+      NEED(2, "Need two parameters for +.") ;
+      BINARY(OP_PLUS) ;
+      NEXT ;
+
+   CASE(OP_MINUS)
+      NEED(2, "Need two parameters for -.") ;
+      BINARY(OP_MINUS) ;
+      NEXT ;
+
+   CASE(OP_TIMES)
+      NEED(2, "Need two parameters for *.") ;
+      BINARY(OP_TIMES) ;
+      NEXT ;
+
+   // dividing by 0, or CELL_MIN by -1, would kill the
+   // process and every other interpreter in it; cellOp()
+   // says no to the one and wraps the other
+   //
+   CASE(OP_DIVIDE)
+      NEED(2, "Need two parameters for /.") ;
+      BINARY(OP_DIVIDE) ;
+      NEXT ;
+
+   CASE(OP_MOD)
+      NEED(2, "Need two parameters for %.") ;
+      BINARY(OP_MOD) ;
+      NEXT ;
+
+   CASE(OP_NEG)
+      NEED(1, "Need one parameter for NEG.") ;
+      UNARY(OP_MINUS, 0, tos.m_value) ;
+      NEXT ;
+
+   CASE(OP_DUP)
+      NEED(1, "Need one parameter for DUP") ;
+      PUSH(tos) ;
+      NEXT ;
+
+   CASE(OP_DROP)
+      NEED(1, "Need one parameter for DROP") ;
+      DROP1 ;
+      NEXT ;
+
+   CASE(OP_SWAP)
+      NEED(2, "Need two parameters for SWAP") ;
+      t = sp[-2] ;
+      sp[-2] = tos ;
+      tos = t ;
+      NEXT ;
+
+   CASE(OP_ROT)
+      // a b c -- b c a
+      NEED(3, "Need three parameters for ROT") ;
+      t = sp[-3] ;
+      sp[-3] = sp[-2] ;
+      sp[-2] = tos ;
+      tos = t ;
+      NEXT ;
+
+   // a number is an address in the data space
+   //
+   CASE(OP_AT)
+      NEED(1, "Need one parameter for @") ;
+      a = tos.m_value ;
+      if ( tos.m_kind == INTEGER ) {
+         if ( (ucell_t) a >= dataSpace.size() ) {
+            FAIL("Error! Address out of range.") ;
+         }
+         tos = Cell(INTEGER, dataSpace[a]) ;
+      } else {
+         if ( tos.m_kind != VARIABLE ) {
+            FAIL("Error! Variable does not exist.") ;
+         }
+         if ( !varIsSet[a] ) {
+            FAIL("Error! Variable does not exist.") ;
+         }
+         tos = Cell(INTEGER, vars[a]) ;
+      }
+      NEXT ;
 
-  //if p1 is greater than or equal to p2, return true. Else, false
-  if(p1.m_value >= p2.m_value)
-    Sptr->params.push(Token (INTEGER, 1, ""));
-  else
-    Sptr->params.push(Token (INTEGER, 0, ""));
+   CASE(OP_STORE)
+      NEED(2, "Need two parameters for !") ;
+      c = tos.m_kind ;
+      if ( c == INTEGER && (ucell_t) tos.m_value >= dataSpace.size() ) {
+         FAIL("Error! Address out of range.") ;
+      }
+      POPVAL(a) ;
+      POPVAL(b) ;
+
+      // if the variable exists, store the value into the variable
+      if ( c == VARIABLE && varIsSet[a] ) {
+         vars[a] = b ;
+      } else if ( c == INTEGER ) {
+         dataSpace[a] = b ;
+      }
+      NEXT ;
 
-}
+   CASE(OP_VARAT)
+      if ( !varIsSet[in->m_arg] ) {
+         PUSH( Cell(VARIABLE, in->m_arg) ) ;     // as @ leaves it
+         FAIL("Error! Variable does not exist.") ;
+      }
+      RESULT(vars[in->m_arg]) ;
+      NEXT ;
+
+   CASE(OP_VARSTORE)
+      NEED(1, "Need two parameters for !") ;
+      POPVAL(a) ;
+      if ( varIsSet[in->m_arg] ) {
+         vars[in->m_arg] = a ;
+      }
+      NEXT ;
 
-void Sally::doEquiv(Sally *Sptr){
- if ( Sptr->params.size() < 2 ){
-    throw out_of_range("Need two parameters for ==");
-  }
+   CASE(OP_VARSET)
+      NEED(1, "Need two parameters for SET") ;
+      if ( varIsSet[in->m_arg] ) {
+         FAIL("Error! Variable already set to a value.") ;
+      }
+      POPVAL(vars[in->m_arg]) ;
+      varIsSet[in->m_arg] = 1 ;
+      NEXT ;
+
+   CASE(OP_LT)
+      NEED(2, "Need two parameters for <") ;
+      BINARY(OP_LT) ;
+      NEXT ;
+
+   CASE(OP_LE)
+      NEED(2, "Need two parameters for <=") ;
+      BINARY(OP_LE) ;
+      NEXT ;
+
+   CASE(OP_EQ)
+      NEED(2, "Need two parameters for ==") ;
+      BINARY(OP_EQ) ;
+      NEXT ;
+
+   CASE(OP_NE)
+      NEED(2, "Need two parameters for !=") ;
+      BINARY(OP_NE) ;
+      NEXT ;
+
+   CASE(OP_GE)
+      NEED(2, "Need two parameters for >=") ;
+      BINARY(OP_GE) ;
+      NEXT ;
+
+   CASE(OP_GT)
+      NEED(2, "Need two parameters for >") ;
+      BINARY(OP_GT) ;
+      NEXT ;
+
+   CASE(OP_AND)
+      NEED(2, "Need two parameters for AND") ;
+      BINARY(OP_AND) ;
+      NEXT ;
+
+   CASE(OP_OR)
+      NEED(2, "Need two parameters for OR") ;
+      BINARY(OP_OR) ;
+      NEXT ;
+
+   CASE(OP_NOT)
+      NEED(1, "Need one parameter for NOT") ;
+      tos = Cell(INTEGER, tos.m_value == 0) ;
+      NEXT ;
+
+   CASE(OP_ADDI)
+      NEED(1, "Need two parameters for +.") ;
+      UNARY(OP_PLUS, tos.m_value, in->m_arg) ;
+      NEXT ;
+
+   CASE(OP_SQUARE)
+      NEED(1, "Need one parameter for DUP") ;
+      UNARY(OP_TIMES, tos.m_value, tos.m_value) ;
+      NEXT ;
+
+   CASE(OP_NIP)
+      // the top stays put; the cell under it goes
+      NEED(2, "Need two parameters for SWAP") ;
+      sp-- ;
+      NEXT ;
+
+   CASE(OP_VARADD)
+      if ( !varIsSet[in->m_arg] ) {
+         FAIL("Error! Variable does not exist.") ;
+      }
+      if ( !cellOp<OP_PLUS>(vars[in->m_arg], ip->m_arg, r) ) {
+         FAIL(cellOpError(OP_PLUS, ip->m_arg)) ;
+      }
+      vars[in->m_arg] = r ;
+      ip++ ;
+      NEXT ;
 
+   CASE(OP_IFLT)
+      BRANCHIF(OP_LT, "Need two parameters for <") ;
+      NEXT ;
 
+   CASE(OP_IFLE)
+      BRANCHIF(OP_LE, "Need two parameters for <=") ;
+      NEXT ;
 
-  Token p1;
-  Token p2;
+   CASE(OP_IFEQ)
+      BRANCHIF(OP_EQ, "Need two parameters for ==") ;
+      NEXT ;
 
-  p2 = Sptr->params.top();
-  Sptr->params.pop();
-  p1 = Sptr->params.top();
-  Sptr->params.pop();
+   CASE(OP_IFNE)
+      BRANCHIF(OP_NE, "Need two parameters for !=") ;
+      NEXT ;
 
-  //if p1 is equivalent to p2, return true. Else, false
-  if(p1.m_value == p2.m_value)
-    Sptr->params.push(Token (INTEGER, 1, ""));
-  else
-    Sptr->params.push(Token (INTEGER, 0, ""));
+   CASE(OP_IFGE)
+      BRANCHIF(OP_GE, "Need two parameters for >=") ;
+      NEXT ;
 
+   CASE(OP_IFGT)
+      BRANCHIF(OP_GT, "Need two parameters for >") ;
+      NEXT ;
+
+   CASE(OP_CALL)
+      if ( rp == rlimit ) {
+         FAIL(overflow_error("Return stack overflow")) ;
+      }
+      *rp++ = ip ;
+      ip = &dict[0] + in->m_arg ;
+      NEXT ;
+
+   CASE(OP_EXIT)
+      ip = *--rp ;
+      NEXT ;
+
+#ifdef SALLY_THREADED
+   L_CALL:
+#else
+      default:
+#endif
+      SYNC ;
+      optab[in->m_op](this) ;
+      RELOAD ;
+      NEXT ;
+
+#ifndef SALLY_THREADED
+      }
+   }
+#endif
 }
 
-void Sally::doNotEq(Sally *Sptr){
- if ( Sptr->params.size() < 2 ){
-    throw out_of_range("Need two parameters for !=");
-  }
-  Token p1;
-  Token p2;
+#undef HOOK
+#undef CASE
+#undef NEXT
+#undef DEPTH
+#undef SYNC
+#undef RELOAD
+#undef FAIL
+#undef NEED
+#undef PUSH
+#undef DROP1
+#undef POPVAL
+#undef RESULT
+#undef BINARY
+#undef UNARY
+#undef BRANCHIF
 
-  p2 = Sptr->params.top();
-  Sptr->params.pop();
-  p1 = Sptr->params.top();
-  Sptr->params.pop();
 
-  //if p1 is not equivalent to p2, return true. Else, false
-  if(p1.m_value != p2.m_value)
-    Sptr->params.push(Token (INTEGER, 1, ""));
-  else
-    Sptr->params.push(Token (INTEGER, 0, ""));
 
-}
 
-void Sally::doLessEqTo(Sally *Sptr){
- if ( Sptr->params.size() < 2 ){
-    throw out_of_range("Need two parameters for <=");
-  }
-  Token p1;
-  Token p2;
 
-  p2 = Sptr->params.top();
-  Sptr->params.pop();
-  p1 = Sptr->params.top();
-  Sptr->params.pop();
 
-  //if p1 is less than or equal to p2, return true. Else, false
-  if(p1.m_value <= p2.m_value)
-    Sptr->params.push(Token (INTEGER, 1, ""));
-  else
-    Sptr->params.push(Token (INTEGER, 0, ""));
-
-}
+void Sally::doDot(Sally *Sptr) {
 
-void Sally::doLessThan(Sally *Sptr){
- if ( Sptr->params.size() < 2 ){
-    throw out_of_range("Need two parameters for <");
-  }
-  Token p1;
-  Token p2;
+   Cell p ;
+   if ( Sptr->params.size() < 1 ) {
+      throw out_of_range("Need one parameter for .") ;
+   }
 
-  p2 = Sptr->params.top();
-  Sptr->params.pop();
-  p1 = Sptr->params.top();
-  Sptr->params.pop();
+   p = Sptr->params.top() ;
+   Sptr->params.pop() ;
 
-  //if p1 is less than p2, return true. Else, false
-  if(p1.m_value < p2.m_value)
-    Sptr->params.push(Token (INTEGER, 1, ""));
-  else
-    Sptr->params.push(Token (INTEGER, 0, ""));
+   if (p.m_kind == INTEGER) {
+      Sptr->out.writeInt(p.m_value) ;
+   } else if (p.m_kind == STRING) {
+      Sptr->out.write(Sptr->pool[p.m_value]) ;
+   } else if (p.m_kind == ARRAY) {
+      Sptr->out.write(Sptr->cellText(p)) ;
+   } else {
+      Sptr->out.write(Sptr->pool[Sptr->varNames[p.m_value]]) ;
+   }
+}
 
+void Sally::doSP(Sally *Sptr) {
+   Sptr->out.put(' ') ;
 }
 
-void Sally::doAND(Sally *Sptr){
- if ( Sptr->params.size() < 2 ){
-    throw out_of_range("Need two parameters for AND");
-  }
-  Token p1;
-  Token p2;
 
-  p1 = Sptr->params.top();
-  Sptr->params.pop();
-  p2 = Sptr->params.top();
-  Sptr->params.pop();
+void Sally::doCR(Sally *Sptr) {
+   Sptr->out.newline() ;
+}
 
-  //if p1 and p2 are both equivalent to true
-  if(p1.m_value == 1 and p2.m_value == 1)
-    Sptr->params.push(Token (INTEGER, 1, ""));
-  else
-    Sptr->params.push(Token (INTEGER, 0, ""));
+// Prints the profile, if there is one, the stack and the
+// variables with the rest of the program's output.
+//
+void Sally::doDUMP(Sally *Sptr) {
+   ostringstream os ;
 
+   Sptr->dump(os) ;
+   Sptr->out.write( os.str() ) ;
 }
 
-void Sally::doOR(Sally *Sptr){
-   if ( Sptr->params.size() < 2 ){
-    throw out_of_range("Need two parameters for OR");
-  }
-  Token p1;
-  Token p2;
+void Sally::doSET(Sally *Sptr){
+  Cell var;
+  Cell val;
 
-  p1 = Sptr->params.top();
+  if ( Sptr->params.size() < 2 ){
+     throw out_of_range("Need two parameters for SET");
+  }
+  var = Sptr->params.top();
   Sptr->params.pop();
-  p2 = Sptr->params.top();
+  val = Sptr->params.top();
   Sptr->params.pop();
 
-  //if p1 or p2 are equivalent to true
-  if(p1.m_value == 1 or p2.m_value == 1)
-    Sptr->params.push(Token (INTEGER, 1, ""));
-  else
-    Sptr->params.push(Token (INTEGER, 0, ""));
-}
+  if (var.m_kind != VARIABLE)
+    throw ("Error! SET needs a variable name.");
 
-void Sally::doNOT(Sally *Sptr){
- if ( Sptr->params.size() < 1 ){
-    throw out_of_range("Need one parameter for NOT");
+  //if the variable has not been set yet, set the variables value
+  if(!Sptr->varIsSet[var.m_value]){
+    Sptr->vars[var.m_value] = val.m_value;
+    Sptr->varIsSet[var.m_value] = 1;
   }
-  Token p1;
-
-  p1 = Sptr->params.top();
-  Sptr->params.pop();
-
-  //if p1 is equivalent to 0, push true onto params
-  if(p1.m_value == 0)
-    Sptr->params.push(Token (INTEGER, 1, ""));
   else
-    Sptr->params.push(Token (INTEGER, 0, ""));
-
-
+    throw ("Error! Variable already set to a value.");
 }
 
-void Sally::doIFTHEN(Sally *Sptr){
-  Token tk;
-  Token second;
-  int val;
 
-  if ( Sptr->params.size() < 1 )
-    throw out_of_range("Need one parameter for IFTHEN");
+// The data space words. Each checks everything before it
+// pops anything.
 
-  //if the previous expression evaluated to true, resume
-  val = Sptr->params.top().m_value;
-  Sptr->params.pop();
-  //if the expression evaluates to true, enter the IFTHEN stmnt
-  if(val == 1){
-    RunToKeyword(Sptr, "ELSE");
-    // run code until corresponding else
-    // skip over until endif
-    SkipToTK(Sptr, "ENDIF", "ELSE");
-  }
-  //if expression evaluates to false, skip to ELSE stmnt
-  else{
-    SkipToTK(Sptr, "ELSE", "IFTHEN");
-    RunToKeyword(Sptr, "ENDIF");
-    // skip over until corresponding else
-    // continue until endif
-  }
+void Sally::doHERE(Sally *Sptr) {
+   Sptr->params.push( Cell(INTEGER, Sptr->dataSpace.size()) ) ;
 }
 
 
-void Sally::RunToKeyword(Sally* Sptr, string match){
-  Token tk;
-  map<string,SymTabEntry>::iterator it ;
-
-  //perform all of the stack operations up until the keyword is found
-  while(1){
-    tk = Sptr->nextToken();
-    if (tk.m_kind == INTEGER || tk.m_kind == STRING) {
-      // if INTEGER or STRING just push onto stack
-      Sptr->params.push(tk);
-    } else {
-      it = Sptr->symtab.find(tk.m_text);
+// n -- ; the n cells after HERE, set to 0
+//
+void Sally::doALLOT(Sally *Sptr) {
+   if ( Sptr->params.size() < 1 ) {
+      throw out_of_range("Need one parameter for ALLOT") ;
+   }
+   cell_t n = Sptr->params.top().m_value ;
 
-      if ( it == Sptr->symtab.end() )  {   // not in symtab
-        Sptr->params.push(tk);
+   if ( n < 0 ) {
+      throw ("Error! ALLOT needs a count of 0 or more.") ;
+   }
+   if ( (ucell_t) n > Sptr->dataLimit - Sptr->dataSpace.size() ) {
+      throw ("Error! Data space full.") ;
+   }
+   Sptr->dataSpace.resize( Sptr->dataSpace.size() + n, 0 ) ;
+   Sptr->params.pop() ;
+}
 
-      } else if (it->second.m_kind == KEYWORD)  {
 
-        //if we encounter a matching keyword, break out of while loop
-        if(tk.m_text == match){
-          return;
-        }
-          // invoke the function for this operation
-        it->second.m_dothis(Sptr);
+// x -- ; x in a new cell at HERE
+//
+void Sally::doCOMMA(Sally *Sptr) {
+   if ( Sptr->params.size() < 1 ) {
+      throw out_of_range("Need one parameter for ,") ;
+   }
+   if ( Sptr->dataSpace.size() >= Sptr->dataLimit ) {
+      throw ("Error! Data space full.") ;
+   }
+   Sptr->dataSpace.push_back( Sptr->params.top().m_value ) ;
+   Sptr->params.pop() ;
+}
 
-      } else if (it->second.m_kind == VARIABLE) {
-        // variables are pushed as tokens
-        tk.m_kind = VARIABLE;
-        Sptr->params.push(tk);
 
-      } else {
-        // default action
-        Sptr->params.push(tk);
-      }
-    }
-  }
-}
+// name -- ; SETs the variable to HERE, so it names the
+// cells allotted after it
+//
+void Sally::doCREATE(Sally *Sptr) {
+   if ( Sptr->params.size() < 1 ) {
+      throw out_of_range("Need one parameter for CREATE") ;
+   }
+   const Cell& var = Sptr->params.top() ;
 
-void Sally::SkipToTK(Sally *Sptr, string match, string opp = NULL){
-  Token tk;
-  int count = 0;
-  while(1){
-    tk = Sptr->nextToken();
-    //once it hits the matching keyword we want to skip to, return
-    if (tk.m_text == match){
-      if (count > 0){
-        --count;
-      }
-      else
-        return;
-    }
-    //increment for every opposite keyword we find.
-    //this accounts for matching the correct IFTHEN with its ELSE
-    else if (tk.m_text == opp){
-      ++count;
-    }
-  }
+   if ( var.m_kind != VARIABLE ) {
+      throw ("Error! CREATE needs a variable name.") ;
+   }
+   if ( Sptr->varIsSet[var.m_value] ) {
+      throw ("Error! Variable already set to a value.") ;
+   }
+   Sptr->vars[var.m_value] = Sptr->dataSpace.size() ;
+   Sptr->varIsSet[var.m_value] = 1 ;
+   Sptr->params.pop() ;
 }
 
-void Sally::DO(Sally* Sptr){
-  Token tkArr[10000];
-  Token tk;
-  Token toInc;
-  int index = 0;
-  int count = 0;
-  map<string,SymTabEntry>::iterator it ;
-
-  while(1){
-    tk = Sptr->nextToken();
-
-    //populate the token array from the stack once it hits the UNTIL, check if
-    //DO has been encountered, then break
-    if (tk.m_text == "UNTIL"){
-      if (count > 0){
-        --count;
-      }
-      else
-        break;
-    }
-    else if (tk.m_text == "DO"){
-      ++count;
-    }
-    tkArr[index] = tk;
-    index++;
-  }
-  //perform all of the stack operations like normal
-  while(1){
 
-    for(int i = 0; i < index; i++){
-
-      tk = tkArr[i];
+// mark -- ; gives back every cell from mark, an earlier
+// HERE, on
+//
+void Sally::doRESET(Sally *Sptr) {
+   if ( Sptr->params.size() < 1 ) {
+      throw out_of_range("Need one parameter for RESET") ;
+   }
+   cell_t mark = Sptr->params.top().m_value ;
 
-      if (tk.m_kind == INTEGER || tk.m_kind == STRING) {
-        // if INTEGER or STRING just push onto stack
-        Sptr->params.push(tk);
-      } else {
-        it = Sptr->symtab.find(tk.m_text);
-
-        if ( it == Sptr->symtab.end() )  {   // not in symtab
-          Sptr->params.push(tk);
-
-        } else if (it->second.m_kind == KEYWORD){
-          // invoke the function for this operation
-          it->second.m_dothis(Sptr);
-
-        } else if (it->second.m_kind == VARIABLE) {
-          // variables are pushed as tokens
-          tk.m_kind = VARIABLE;
-          Sptr->params.push(tk);
-
-        } else {
-          // default action
-          Sptr->params.push(tk);
-        }
-      }
-    }
-    //check the expression evaluation, if the condition is met, break.
-    Token var = Sptr->params.top();
-    Sptr->params.pop();
-    if(var.m_value == 1){
-      break;
-    }
-  }
+   if ( mark < 0 || (ucell_t) mark > Sptr->dataSpace.size() ) {
+      throw ("Error! Address out of range.") ;
+   }
+   Sptr->dataSpace.resize(mark) ;
+   Sptr->params.pop() ;
 }
-
@@ -9,13 +9,38 @@
 
 #include <iostream>
 #include <string>
-#include <list>
-#include <stack>
 #include <map>
+#include <vector>
 #include <stdexcept>
+#include <limits>
 using namespace std ;
 
 
+// Integer cells are 64 bits. Compile with
+// -DSALLY_CELL_BITS=32 for 32 bit ones.
+//
+// Arithmetic on them wraps around, as C does for unsigned
+// numbers. Compile with -DSALLY_CHECKED_ARITH to have an
+// overflow stop the program with an error instead.
+//
+#ifndef SALLY_CELL_BITS
+#define SALLY_CELL_BITS 64
+#endif
+
+#if SALLY_CELL_BITS == 64
+typedef long long cell_t ;
+typedef unsigned long long ucell_t ;
+#elif SALLY_CELL_BITS == 32
+typedef int cell_t ;
+typedef unsigned ucell_t ;
+#else
+#error "SALLY_CELL_BITS must be 32 or 64"
+#endif
+
+#define CELL_MIN numeric_limits<cell_t>::min()
+#define CELL_MAX numeric_limits<cell_t>::max()
+
+
 // thrown by lexical parser when end of file reached
 //
 class EOProgram : public runtime_error {
@@ -24,20 +49,401 @@ public:
 } ;
 
 
-enum TokenKind { UNKNOWN, KEYWORD, INTEGER, VARIABLE, STRING } ;
+// thrown by the compiler when the program is malformed,
+// e.g. an ELSE or UNTIL without its IFTHEN or DO
+//
+class CompileError : public runtime_error {
+public:
+   CompileError(const string& what) : runtime_error(what) { }
+} ;
+
+
+enum TokenKind { UNKNOWN, KEYWORD, INTEGER, VARIABLE, STRING, ARRAY } ;
 
 
 // lexical parser returns a token
 // programs are lists of tokens
 //
+// the text of STRING and UNKNOWN (name) tokens is kept in the
+// interpreter's string pool; m_value is its handle there.
+//
 class Token {
 
 public:
 
-   Token(TokenKind kind=UNKNOWN, int val=0, string txt="" ) ;
+   Token(TokenKind kind=UNKNOWN, cell_t val=0, int line=0) ;
+   TokenKind m_kind ;
+   cell_t m_value ;   // numeric value or string pool handle
+   int m_line ;       // source line it came from, 1 is the first
+
+} ;
+
+
+
+// Interned strings.
+//
+// Every distinct string is stored once and is known by its
+// handle, a small integer. Handles are never reused, so they
+// stay valid for the life of the pool.
+//
+class StringPool {
+
+public:
+
+   StringPool() ;
+
+   // handle of the len chars at s. added if new.
+   //
+   int intern(const char *s, int len) ;
+   int intern(const string& s) { return intern(s.data(), s.size()) ; }
+
+   // handle of the len chars at s, -1 if not in the pool
+   //
+   int find(const char *s, int len) const ;
+   int find(const string& s) const { return find(s.data(), s.size()) ; }
+
+   const string& operator[](int h) const { return m_strings[h] ; }
+   int size() const { return m_strings.size() ; }
+
+private:
+
+   vector<string> m_strings ;   // indexed by handle
+   vector<int> m_table ;        // hash table of handle+1, 0 if empty
+
+   static unsigned hash(const char *s, int len) ;
+   void rehash() ;
+
+} ;
+
+
+
+// execute() dispatches with GCC's labels-as-values (direct
+// threaded code) where available. Compile with
+// -DSALLY_NO_THREADED to use the portable switch instead.
+//
+#if defined(__GNUC__) && !defined(SALLY_NO_THREADED)
+#define SALLY_THREADED
+#endif
+
+
+// one cell of the parameter stack.
+//
+// m_value holds the integer for INTEGER cells, the variable
+// slot for VARIABLE cells, the string pool handle for
+// STRING cells and the index in Sally::arrays for ARRAY
+// cells. No strings or arrays are copied around.
+//
+class Cell {
+
+public:
+
+   Cell(TokenKind kind=INTEGER, cell_t val=0) : m_kind(kind), m_value(val) { }
    TokenKind m_kind ;
-   int m_value ;      // if it's a known numeric value
-   string m_text ;    // original text that created this token
+   cell_t m_value ;
+
+} ;
+
+
+
+// Sally Forth parameter stack.
+//
+// A fixed-size array of cells allocated once. push() throws
+// overflow_error when the stack is full; callers check size()
+// before popping.
+//
+// execute() works on the array itself, keeping the top cell
+// and the top pointer in locals while it runs. There is a
+// spare cell below the bottom so that m_top[-1] can be
+// written and read even when the stack is empty.
+//
+class ParamStack {
+
+public:
+
+   ParamStack(int depth) ;
+   ~ParamStack() ;
+
+   int size() const { return m_top - m_base ; }
+   Cell& top() { return m_top[-1] ; }
+   void pop() { m_top-- ; }
+   void clear() { m_top = m_base ; }
+
+   void push(const Cell& c) {
+      if (m_top == m_limit) {
+         throw overflow_error("Parameter stack overflow") ;
+      }
+      *m_top++ = c ;
+   }
+
+   // the cell i places below the top
+   //
+   Cell& peek(int i) { return m_top[-1-i] ; }
+
+   // the array, for execute(): bottom, one past the top,
+   // and one past the last usable cell
+   //
+   Cell *base() const { return m_base ; }
+   Cell *end() const { return m_top ; }
+   Cell *limit() const { return m_limit ; }
+   void setEnd(Cell *top) { m_top = top ; }
+
+private:
+
+   Cell *m_base ;     // bottom of the stack
+   Cell *m_top ;      // one past the top cell
+   Cell *m_limit ;    // one past the last usable cell
+
+   ParamStack(const ParamStack&) ;              // not copyable
+   ParamStack& operator=(const ParamStack&) ;
+
+} ;
+
+
+
+// Buffered output of a Sally Forth interpreter.
+//
+// . SP and CR write here instead of straight to a stream,
+// so output goes out in large writes. When it goes out
+// depends on the flush policy:
+//
+//   FLUSH_AT_EXIT     only when flush() is called; the
+//                     buffer grows as needed
+//   FLUSH_WHEN_FULL   whenever the buffer fills up
+//   FLUSH_EACH_LINE   at every CR too, for interactive use
+//
+class OutputSink {
+
+public:
+
+   enum FlushPolicy { FLUSH_AT_EXIT, FLUSH_WHEN_FULL, FLUSH_EACH_LINE } ;
+
+   OutputSink(ostream& os, FlushPolicy policy, int size) ;
+   ~OutputSink() ;
+
+   void put(char c) {
+      if ( m_len == m_size ) makeRoom(1) ;
+      m_buf[m_len++] = c ;
+   }
+   void write(const char *s, int len) ;
+   void write(const string& s) { write(s.data(), s.size()) ; }
+   void writeInt(long long v) ;
+   void newline() ;
+   void flush() ;
+
+private:
+
+   ostream& m_os ;
+   FlushPolicy m_policy ;
+   char *m_buf ;
+   int m_len ;        // # of chars in m_buf
+   int m_size ;       // room in m_buf
+
+   void makeRoom(int n) ;
+
+   OutputSink(const OutputSink&) ;              // not copyable
+   OutputSink& operator=(const OutputSink&) ;
+
+} ;
+
+
+
+// run-time settings of a Sally Forth interpreter
+//
+class SallyOptions {
+
+public:
+
+   SallyOptions() ;
+   int m_stackDepth ;     // max # of cells on the parameter stack
+   int m_returnDepth ;    // max # of nested calls
+   int m_dataSpace ;      // max # of cells ALLOT can reserve
+   int m_arraySpace ;     // max # of cells in all arrays at once
+   int m_inlineLimit ;    // copy definitions this short (in
+                          // instructions) instead of calling them
+   bool m_optimize ;      // fold constants, run the peephole optimizer
+   bool m_fusionReport ;  // print what it did at the end
+   bool m_profile ;       // count and time every word, report at
+                          // the end. fixed for the interpreter's life
+   int m_trace ;          // remember this many of the last words
+                          // run, 0 for none. fixed as well
+   bool m_imageCache ;    // loadFile() keeps the compiled program
+                          // in a .sallyc image next to the file
+   bool m_verify ;        // check what each unit does to the stack
+                          // before it runs; run it without the
+                          // underflow checks if it can't underflow
+   bool m_jit ;           // compile hot loops to native code. off
+                          // when profiling or tracing
+   int m_jitThreshold ;   // times round before a loop is compiled
+   OutputSink::FlushPolicy m_flushPolicy ;
+   int m_outputBuffer ;   // size of the output buffer in chars
+
+} ;
+
+
+
+// opcodes of a compiled Sally Forth program.
+//
+// OP_DUMP through OP_NOT are the builtin words; the symbol
+// table maps each keyword to its opcode.
+//
+// Compiled programs are cached in .sallyc images. Changing
+// the opcodes, the keywords or what the compiler makes of a
+// program means bumping SALLY_IMAGE_VERSION, so old images
+// are thrown away.
+//
+#define SALLY_IMAGE_VERSION 6
+
+enum OpCode {
+   OP_NOP,
+   OP_HALT,      // end of the code
+   OP_INT,       // push the integer m_arg
+   OP_STR,       // push string literal with pool handle m_arg
+   OP_NAME,      // push the name of variable slot m_arg
+
+   // branch targets are m_arg instructions away from the
+   // branch
+   //
+   OP_IFTHEN,    // pop; unless 1, jump past the ELSE
+   OP_ELSE,      // jump to the end of the IFTHEN
+   OP_ENDIF,     // compiles to nothing
+   OP_DO,        // compiles to nothing
+   OP_UNTIL,     // pop; unless 1, jump back to the loop body
+
+   OP_DUMP,
+   OP_PLUS, OP_MINUS, OP_TIMES, OP_DIVIDE, OP_MOD, OP_NEG,
+   OP_DOT, OP_SP, OP_CR,
+   OP_DUP, OP_DROP, OP_SWAP, OP_ROT,
+   OP_SET, OP_AT, OP_STORE,
+   OP_LT, OP_LE, OP_EQ, OP_NE, OP_GE, OP_GT,
+   OP_AND, OP_OR, OP_NOT,
+
+   // @ ! and SET compiled right after the variable's name
+   //
+   OP_VARAT, OP_VARSTORE, OP_VARSET,
+
+   // colon definitions. : and ; only exist at compile time
+   //
+   OP_COLON, OP_SEMI,
+   OP_CALL,      // call the definition at dict[m_arg]
+   OP_EXIT,      // return from a definition
+
+   // superinstructions made by Sally::optimize()
+   //
+   OP_ADDI,      // add m_arg to the top
+   OP_SQUARE,    // DUP *
+   OP_NIP,       // SWAP DROP
+   OP_VARADD,    // add the m_arg of the OP_DATA after it to slot m_arg
+   OP_DATA,      // operand of the instruction before; not executed
+   OP_IFLT, OP_IFLE, OP_IFEQ, OP_IFNE, OP_IFGE, OP_IFGT,
+                 // compare and IFTHEN. same order as OP_LT ...
+
+   // array words, in SallyArray.cpp
+   //
+   OP_ARRAY, OP_AFILL, OP_ACOPY, OP_ALEN, OP_AAT, OP_ASTORE,
+   OP_APLUS, OP_AMINUS, OP_ATIMES,
+   OP_ALT, OP_ALE, OP_AEQ, OP_ANE, OP_AGE, OP_AGT,
+                 // same order as OP_LT ...
+   OP_ASUM, OP_AMIN, OP_AMAX,
+   OP_AMARK, OP_ARELEASE,
+
+   // the data space
+   //
+   OP_HERE, OP_ALLOT, OP_COMMA, OP_CREATE, OP_RESET,
+
+   // UNTIL of a loop the JIT keeps count of; m_arg is its
+   // index in jitLoops. made just before the code runs, so
+   // never optimized or cached
+   //
+   OP_JITUNTIL,
+
+   OP_COUNT      // number of opcodes, not an opcode
+} ;
+
+
+// true for opcodes whose m_arg is a branch offset
+//
+bool isBranch(OpCode op) ;
+
+
+// The arithmetic, comparison and logic words on integers,
+// one instance for each opcode, as execute(), fold() and the
+// JIT all do them. cellOp<op>(a, b, r) puts a op b in r, or
+// returns false if it can't be done: a division by 0, or an
+// overflow with SALLY_CHECKED_ARITH. op is a constant, so
+// each instance comes down to the few instructions of its
+// word where it is used.
+//
+template <int OP>
+inline bool cellOp(cell_t a, cell_t b, cell_t& r) {
+   switch (OP) {
+#ifdef SALLY_CHECKED_ARITH
+   case OP_PLUS:    return !__builtin_add_overflow(a, b, &r) ;
+   case OP_MINUS:   return !__builtin_sub_overflow(a, b, &r) ;
+   case OP_TIMES:   return !__builtin_mul_overflow(a, b, &r) ;
+#else
+   case OP_PLUS:    r = (ucell_t) a + (ucell_t) b ; return true ;
+   case OP_MINUS:   r = (ucell_t) a - (ucell_t) b ; return true ;
+   case OP_TIMES:   r = (ucell_t) a * (ucell_t) b ; return true ;
+#endif
+
+   // CELL_MIN / -1 would trap, so -1 is a NEG
+   //
+   case OP_DIVIDE:
+      if ( b == 0 ) return false ;
+      if ( b == -1 ) return cellOp<OP_MINUS>(0, a, r) ;
+      r = a / b ;
+      return true ;
+   case OP_MOD:
+      if ( b == 0 ) return false ;
+      r = (b == -1) ? 0 : a % b ;
+      return true ;
+
+   case OP_LT:      r = a < b ; return true ;
+   case OP_LE:      r = a <= b ; return true ;
+   case OP_EQ:      r = a == b ; return true ;
+   case OP_NE:      r = a != b ; return true ;
+   case OP_GE:      r = a >= b ; return true ;
+   case OP_GT:      r = a > b ; return true ;
+   case OP_AND:     r = (a == 1 && b == 1) ; return true ;
+   case OP_OR:      r = (a == 1 || b == 1) ; return true ;
+   default:         return false ;
+   }
+}
+
+
+// what to say when cellOp<op>(a, b, r) fails
+//
+inline const char *cellOpError(int op, cell_t b) {
+   if ( (op == OP_DIVIDE || op == OP_MOD) && b == 0 ) {
+      return "Error! Division by zero." ;
+   }
+   return "Error! Integer overflow." ;
+}
+
+
+// constant folds done by Sally::fold() and peephole fusions
+// done by Sally::optimize(), counted for the report
+//
+enum Fusion {
+   FUSE_FOLD, FUSE_BRANCH,
+   FUSE_ADDI, FUSE_SQUARE, FUSE_NIP, FUSE_VARADD, FUSE_IF,
+   FUSE_COUNT
+} ;
+
+
+// one instruction of a compiled program
+//
+class Instr {
+
+public:
+
+   Instr(OpCode op=OP_NOP, cell_t arg=0, int line=0) ;
+   OpCode m_op ;
+   int m_line ;       // source line of the word it came from
+   cell_t m_arg ;     // operand: literal value, pool handle, slot
+#ifdef SALLY_THREADED
+   const void *m_handler ;   // address of the code for m_op
+#endif
 
 } ;
 
@@ -55,10 +461,176 @@ typedef void (* operation_t)(Sally *Sptr) ;
 //
 class SymTabEntry {
 public:
-  SymTabEntry(TokenKind kind=UNKNOWN, int val=0, operation_t fptr=NULL) ;
+   SymTabEntry(TokenKind kind=UNKNOWN, int val=0, operation_t fptr=NULL,
+               OpCode op=OP_NOP) ;
    TokenKind m_kind ;
-   int m_value ;            // variables' values are stored here
+   int m_value ;            // for a colon definition, where its
+                            // body starts in dict; else 0
    operation_t m_dothis ;   // pointer to a function that does the work
+   OpCode m_opcode ;        // what keywords compile to
+} ;
+
+
+// Execution profile of a Sally Forth interpreter, kept
+// when SallyOptions::m_profile is on.
+//
+// Cycles are read from the time stamp counter where there
+// is one, else they are nanoseconds. Every instruction is
+// charged from its dispatch to the next one's.
+//
+class Profile {
+
+public:
+
+   Profile() ;
+
+   long long m_count[OP_COUNT] ;             // runs of each opcode
+   unsigned long long m_cycles[OP_COUNT] ;   // and time spent
+
+   // calls of colon definitions and time spent in them,
+   // callees included. indexed by where the body is in dict
+   //
+   vector<long long> m_calls ;
+   vector<unsigned long long> m_callCycles ;
+
+   // reads and writes of each variable slot
+   //
+   vector<long long> m_reads ;
+   vector<long long> m_writes ;
+
+   // definitions being run: body and time of the call
+   //
+   vector< pair<int, unsigned long long> > m_frames ;
+
+   int m_last ;                   // opcode being run
+   unsigned long long m_stamp ;   // when it started
+
+} ;
+
+
+
+// one word run, as the trace remembers it
+//
+class TraceEntry {
+
+public:
+
+   int m_op ;         // its OpCode
+   cell_t m_arg ;
+   cell_t m_data ;    // the amount of an OP_VARADD
+   int m_line ;       // source line
+   int m_depth ;      // # of cells on the stack before it ran
+
+} ;
+
+
+
+// The last words run by an interpreter, kept when
+// SallyOptions::m_trace is on.
+//
+// A ring of entries allocated once; recording a word is a
+// few stores, cheap enough to leave on. The oldest entries
+// are written over.
+//
+class TraceRing {
+
+public:
+
+   // room for size entries, rounded up to a power of 2.
+   // 0 makes an empty ring that must not be recorded in
+   //
+   TraceRing(int size) ;
+
+   void record(const Instr *in, int depth) {
+      TraceEntry& e = m_ring[m_next++ & m_mask] ;
+      e.m_op = in->m_op ;
+      e.m_arg = in->m_arg ;
+      e.m_data = (in->m_op == OP_VARADD) ? in[1].m_arg : 0 ;
+      e.m_line = in->m_line ;
+      e.m_depth = depth ;
+   }
+
+   // # of entries held, and the i-th oldest of them
+   //
+   int size() const {
+      return (m_next < m_ring.size()) ? m_next : m_ring.size() ;
+   }
+   const TraceEntry& operator[](int i) const {
+      return m_ring[(m_next - size() + i) & m_mask] ;
+   }
+
+private:
+
+   vector<TraceEntry> m_ring ;
+   unsigned long long m_mask ;
+   unsigned long long m_next ;   // # of words ever recorded
+
+} ;
+
+
+
+// What running some code does to the depth of the stack,
+// as worked out by Sally::verify(). Started with fewer than
+// m_need cells it may underflow, and with fewer than m_sure
+// it will. When it is done the stack is m_lo to m_hi cells
+// deeper. SALLY_UNBOUNDED stands for no limit.
+//
+#define SALLY_UNBOUNDED (1 << 28)
+
+class StackEffect {
+
+public:
+
+   StackEffect(int need=0, int sure=0, int lo=0, int hi=0) ;
+   int m_need ;
+   int m_sure ;
+   int m_lo ;
+   int m_hi ;
+
+} ;
+
+
+
+// Loops compiled to native code, in SallyJit.cpp.
+//
+// Native code for a loop is called with the variables and
+// room for SALLY_JIT_CELLS cells. It runs until the loop is
+// done or it comes to something it leaves to the
+// interpreter, and returns which of the loop's exits it took.
+//
+#define SALLY_JIT_CELLS 9
+
+typedef int (* jit_fn)(cell_t *vars, cell_t *spill) ;
+
+
+// where native code gives back to the interpreter
+//
+class JitExit {
+
+public:
+
+   int m_resume ;     // word to go on at, from the UNTIL
+   int m_depth ;      // # of cells to push from the spill area
+
+} ;
+
+
+
+// a DO ... UNTIL loop, as the JIT sees it
+//
+class JitLoop {
+
+public:
+
+   JitLoop(int offset=0) ;
+   int m_offset ;        // branch offset of its UNTIL
+   int m_count ;         // times round so far
+   bool m_failed ;       // has words the JIT can't compile
+   jit_fn m_native ;     // its code, NULL until compiled
+   void *m_mem ;         // mapping holding the code
+   size_t m_memSize ;
+   vector<JitExit> m_exits ;
+
 } ;
 
 
@@ -69,10 +641,59 @@ class Sally {
 
 public:
 
-   Sally(istream& input_stream=cin) ;  // make a Sally Forth interpreter
+   // make a Sally Forth interpreter. Messages (end of
+   // program, errors, reports) go to error_stream.
+   // Interpreters share nothing, so each can run on a
+   // thread of its own.
+   //
+   Sally(istream& input_stream=cin, ostream& output_stream=cout,
+         const SallyOptions& opts=SallyOptions(),
+         ostream& error_stream=cerr) ;
+   ~Sally() ;
 
    void mainLoop() ;  // do the main interpreter loop
 
+   // take the program from a file instead of the input stream
+   //
+   bool loadFile(const char *path) ;
+
+
+   // Embedding. Instead of mainLoop(), a program can be fed
+   // to the interpreter a chunk at a time with eval().
+   // Definitions, variables and the stack carry over from
+   // one chunk to the next, and the output of each chunk is
+   // flushed to the output stream before eval() returns.
+   //
+   // If a chunk fails, the rest of it is dropped and eval()
+   // returns false; lastError() has the messages mainLoop()
+   // would have printed. The interpreter can go on with the
+   // next chunk.
+   //
+   bool eval(const string& source) ;
+   const string& lastError() const { return errorText ; }
+
+
+   // the stack, cell 0 being the top. stackCell() throws
+   // out_of_range for cells that are not there; cellText()
+   // is what . would print for a cell
+   //
+   int stackDepth() const { return params.size() ; }
+   Cell stackCell(int i) ;
+   string cellText(const Cell& c) ;
+   void push(cell_t value) { params.push( Cell(INTEGER, value) ) ; }
+   void clearStack() { params.clear() ; }
+
+
+   // value of the variable called name; false unless it
+   // has been SET
+   //
+   bool variable(const string& name, cell_t& value) ;
+
+
+   // # of loops the JIT has compiled so far
+   //
+   int nativeLoops() const { return jitCompiled ; }
+
 
 private:
 
@@ -81,71 +702,325 @@ private:
    istream& istrm ;
 
 
-   // Sally Forth operations to be interpreted
+   // Where the output and the messages go
+   //
+   OutputSink out ;
+   ostream& errs ;
+
+
+   // what went wrong in the last eval(), empty if nothing
    //
-   list<Token> tkBuffer ;
+   string errorText ;
+
+
+   // Sally Forth operations to be interpreted.
+   // tkNext is the next one to hand out.
+   //
+   vector<Token> tkBuffer ;
+   size_t tkNext ;
+
+
+   // true once all the input is in tkBuffer
+   //
+   bool inputDone ;
+
+
+   // # of lines fillBuffer() has read
+   //
+   int lineNo ;
 
 
    // Sally Forth parameter stack
    //
-   stack<Token> params ;
+   ParamStack params ;
 
 
    // Sally Forth symbol table
-   // keywords and variables are store here
+   // keywords and colon definitions are stored here.
+   // a definition's m_value is where its body starts in dict
    //
    map<string,SymTabEntry> symtab ;
 
 
+   // string literals and names of the program.
+   // STRING cells and tokens refer to these by handle.
+   //
+   StringPool pool ;
+
+
+   // symbol table entry of each pool handle that is the
+   // name of a keyword, NULL for other handles
+   //
+   vector<SymTabEntry *> keywords ;
+
+
+   // Sally Forth variables
+   //
+   // every name that is not a keyword gets a slot number
+   // when it is compiled. values are kept in vars, indexed
+   // by slot. varIsSet says whether SET has been done.
+   //
+   vector<int> varSlots ;     // slot of each pool handle, or -1
+   vector<int> varNames ;     // pool handle of each slot
+   vector<cell_t> vars ;
+   vector<char> varIsSet ;
+
+
+   // arrays made by ARRAY and ACOPY, indexed by the m_value
+   // of ARRAY cells. ARELEASE gives back all of them from a
+   // mark, an earlier AMARK, on; the next ones made take
+   // their places. Together they hold arrayCells cells,
+   // never more than arrayLimit
+   //
+   vector< vector<cell_t> > arrays ;
+   size_t arrayCells ;
+   size_t arrayLimit ;
+
+
+   // the data space, one block of cells. ALLOT and , take
+   // cells at its end, HERE, and RESET gives back all of
+   // them from a mark on at once; the memory is kept for the
+   // next ALLOT. Addresses are cell numbers, so @ and ! on a
+   // number read and write dataSpace[number]. It grows no
+   // bigger than dataLimit cells
+   //
+   vector<cell_t> dataSpace ;
+   size_t dataLimit ;
+
+
+   // builtin function for each opcode.
+   // filled in from the m_dothis fields of symtab
+   //
+   vector<operation_t> optab ;
+
+
+   // compiled code of the current program unit
+   //
+   vector<Instr> code ;
+
+
+   // compiled bodies of colon definitions, each ending in
+   // OP_EXIT. dictThreaded instructions have their handler
+   // filled in, for the instance of run() that dictHooks
+   // says.
+   //
+   vector<Instr> dict ;
+   size_t dictThreaded ;
+   int dictHooks ;
+
+
+   // Sally Forth return stack, used by OP_CALL
+   //
+   vector<const Instr *> rstack ;
+
+
+   // definitions this short are copied in by the compiler
+   //
+   int inlineLimit ;
+
+
+   // optimizer settings, and how many times each fold
+   // and fusion was done
+   //
+   bool optimizeOn ;
+   bool fusionReport ;
+   int fusions[FUSE_COUNT] ;
+
+
+   // execution profile; only kept up when profileOn
+   //
+   bool profileOn ;
+   Profile prof ;
+
+
+   // the last words run; only kept up when traceOn
+   //
+   bool traceOn ;
+   TraceRing trace ;
+
+
+   // .sallyc images, in SallyImage.cpp. imagePath is where
+   // to write one after the next compile, empty if none is
+   // wanted. codeReady says code came from an image and
+   // needs no compiling.
+   //
+   bool imageCache ;
+   string imagePath ;
+   unsigned long long sourceHash ;
+   long sourceSize ;
+   bool codeReady ;
+
+
+   // stack effects, in SallyVerify.cpp. verifyOn is
+   // SallyOptions::m_verify; dictEffects holds the effects
+   // of the colon definitions worked out so far, by where
+   // their bodies start
+   //
+   bool verifyOn ;
+   map<int,StackEffect> dictEffects ;
+
+
+   // the JIT, in SallyJit.cpp. Loops of colon definitions
+   // come first in jitLoops and stay; those of the current
+   // unit come after jitDictLoops and go with it. dictJitted
+   // instructions of dict have had their UNTILs counted.
+   //
+   bool jitOn ;
+   int jitThreshold ;
+   int jitCompiled ;
+   vector<JitLoop> jitLoops ;
+   size_t jitDictLoops ;
+   size_t dictJitted ;
+   cell_t jitSpill[SALLY_JIT_CELLS] ;
+
+
    // add tokens from input to tkBuffer
    //
    bool fillBuffer() ;
 
 
+   // add the tokens of the chars from p to end to tkBuffer
+   //
+   void lex(const char *p, const char *end) ;
+
+
    // give me one more token.
    // calls fillBuffer() for you if needed.
    //
    Token nextToken() ;
 
 
+   // compile the next unit of the program into code,
+   // then run it
+   //
+   void compile() ;
+   void execute() ;
+
+
+   // print the message for the exception being handled
+   //
+   void reportError(ostream& os) ;
+
+
+   // the engine of execute(). HOOKS says what it keeps
+   // track of as it goes; run<0> pays for none of it.
+   // run<HOOK_UNCHECKED> runs code verify() passed, and
+   // doesn't look for stack underflow
+   //
+   enum { HOOK_PROFILE = 1, HOOK_TRACE = 2, HOOK_UNCHECKED = 4 } ;
+   template <int HOOKS> void run() ;
+
+
+   // finish a colon definition; its body is in code
+   // from start on
+   //
+   void define(int name, int start) ;
+   void enterDefinition(int name, int where) ;
+   int dictLength(int start) ;
+
+
+   // constant folding and peephole optimizer, in SallyOpt.cpp
+   //
+   void fold(vector<Instr>& prog) ;
+   void optimize(vector<Instr>& prog) ;
+   void reportFusions(ostream& os) ;
+
+
+   // profiling and tracing, in SallyProf.cpp. profile() is
+   // called before each instruction runs. dump() prints the
+   // profile, the trace, the stack and the variables
+   //
+   void profileStart() ;
+   void profile(const Instr *in) ;
+   void reportProfile(ostream& os) ;
+   void reportTrace(ostream& os) ;
+   void dump(ostream& os) ;
+   string definitionName(int body) ;
+   string wordText(int op, cell_t arg, cell_t data) ;
+
+
+   // stack effect checks, in SallyVerify.cpp. verify()
+   // throws CompileError if the code of the unit is sure to
+   // underflow the stack, and says whether it can't
+   //
+   bool verify() ;
+   void depths(const Instr *prog, int n, vector<int>& lo,
+               vector<int>& hi, vector<char>& always) ;
+   StackEffect wordEffect(const Instr *in) ;
+   StackEffect definitionEffect(int body) ;
+
+
+   // array words, in SallyArray.cpp. arrayWords() adds
+   // them to the symbol table; arrayOf() is the array of an
+   // ARRAY cell, and throws for any other. arrayRoom()
+   // counts the cells of a new array against arrayLimit
+   //
+   void arrayWords() ;
+   vector<cell_t>& arrayOf(const Cell& c) ;
+   void arrayRoom(cell_t n) ;
+
+
+   // findImage() loads the image of the len chars of source
+   // at src, read from path, if there is a good one.
+   // Otherwise it arranges for one to be written by
+   // saveImage() once the source is compiled. loadImage()
+   // changes nothing unless the image is good and up to date.
+   //
+   bool findImage(const char *path, const char *src, long len) ;
+   bool loadImage(const string& path) ;
+   void saveImage() ;
+
+
+   // jitPrepare() turns the UNTILs of new code into
+   // OP_JITUNTILs before it runs. jitLoop() is run by one
+   // that loops back; it returns where to go on.
+   //
+   void jitPrepare() ;
+   const Instr *jitLoop(const Instr *in) ;
+   bool jitCompile(JitLoop& loop, const Instr *until) ;
+   void jitRelease(size_t from) ;
+
+
+   // keyword named by a pool handle, NULL if not a keyword
+   //
+   SymTabEntry *keyword(int h) ;
+
+
+   // slot number of the variable named by a pool handle.
+   // made up if new.
+   //
+   int varSlot(int h) ;
+
+
    // static member functions that do what has
    // to be done for each Sally Forth operation
    //
    // pointers to these functions are stored
    // in the symbol table
    //
-   static void doDUMP(Sally *Sptr) ;    // for debugging
-
-   static void doPlus(Sally *Sptr) ;
-   static void doMinus(Sally *Sptr) ;
-   static void doTimes(Sally *Sptr) ;
-   static void doDivide(Sally *Sptr) ;
-   static void doMod(Sally *Sptr) ;
-   static void doNEG(Sally *Sptr) ;
+   static void doDUMP(Sally *Sptr) ;    // profile, stack and variables
 
    static void doDot(Sally *Sptr) ;
    static void doSP(Sally *Sptr) ;
    static void doCR(Sally *Sptr) ;
-  static void doDUP(Sally *Sptr) ;
-  static void doDROP(Sally *Sptr) ;
-  static void doSWAP(Sally *Sptr) ;
-  static void doROT(Sally *Sptr) ;
   static void doSET(Sally *Sptr) ;
-  static void doAT(Sally *Sptr) ;
-  static void doSTORE(Sally *Sptr) ;
-  static void doGrtThan(Sally *Sptr) ;
-  static void doGrtEqTo(Sally *Sptr) ;
-  static void doEquiv(Sally *Sptr) ;
-  static void doNotEq(Sally *Sptr) ;
-  static void doLessEqTo(Sally *Sptr) ;
-  static void doLessThan(Sally *Sptr) ;
-  static void doAND(Sally *Sptr) ;
-  static void doOR(Sally *Sptr) ;
-  static void doNOT(Sally *Sptr) ;
-  static void doIFTHEN(Sally *Sptr) ;
-  static void RunToKeyword(Sally *Sptr,string match) ;
-  static void SkipToTK(Sally *Sptr, string match, string opp) ;
-  static void DO(Sally*Sptr);
+
+   static void doHERE(Sally *Sptr) ;
+   static void doALLOT(Sally *Sptr) ;
+   static void doCOMMA(Sally *Sptr) ;
+   static void doCREATE(Sally *Sptr) ;
+   static void doRESET(Sally *Sptr) ;
+
+   static void doARRAY(Sally *Sptr) ;
+   static void doAFILL(Sally *Sptr) ;
+   static void doACOPY(Sally *Sptr) ;
+   static void doALEN(Sally *Sptr) ;
+   static void doAAT(Sally *Sptr) ;
+   static void doASTORE(Sally *Sptr) ;
+   template <int OP> static void doAMAP(Sally *Sptr) ;      // A+ ... A>
+   template <int OP> static void doAREDUCE(Sally *Sptr) ;   // ASUM AMIN AMAX
+   static void doAMARK(Sally *Sptr) ;
+   static void doARELEASE(Sally *Sptr) ;
 } ;
 
 #endif
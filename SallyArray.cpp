@@ -0,0 +1,484 @@
+// File: SallyArray.cpp
+//
+//
+// Array words of the Sally Forth interpreter
+//
+// An ARRAY cell stands for an array of integers kept by the
+// interpreter. Arrays are made by ARRAY and ACOPY and kept
+// until an ARELEASE gives them back. The words that change
+// an array change it in place and leave it on the stack, so
+// a loop that works on the same arrays allocates nothing.
+//
+//    n v ARRAY          -- a     n cells, each v
+//    a v AFILL          -- a     every cell set to v
+//    a ACOPY            -- b     a new array like a
+//    a ALEN             -- n     # of cells
+//    a i A@             -- x     cell i, the first being 0
+//    x a i A!           --       x stored in cell i
+//    a b A+ A- A*       -- a     a[i] op b[i], or a[i] op b
+//                                when b is a number
+//    a b A< A<= A==     -- a     the same, making a mask: 1
+//        A!= A>= A>              where it holds, else 0
+//    a ASUM AMIN AMAX   -- x
+//    AMARK              -- m     mark of the next array made
+//    m ARELEASE         --       frees every array from m on
+//
+// An ARRAY cell of a freed array is an error to use, until
+// a new array takes its place.
+//
+// The elementwise words and the reductions are done by
+// kernels written once with GCC's vector extensions and
+// compiled for AVX2, for SSE4.2 and for plain x86-64. The
+// first one the CPU can run is picked the first time each
+// is used. Other machines get the scalar kernels.
+//
+// Cells come out as cellOp() makes them, so arithmetic wraps
+// around. With SALLY_CHECKED_ARITH, A+ A- A* and ASUM use
+// the scalar kernels, which stop at the first overflow; the
+// cells before it have been changed by then.
+//
+
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <cstring>
+using namespace std ;
+
+#include "Sally.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define SALLY_SIMD
+#endif
+
+
+// Names of the array words for messages, in OpCode order
+// from OP_ARRAY.
+//
+static const char *arrayNames[] = {
+   "ARRAY", "AFILL", "ACOPY", "ALEN", "A@", "A!",
+   "A+", "A-", "A*",
+   "A<", "A<=", "A==", "A!=", "A>=", "A>",
+   "ASUM", "AMIN", "AMAX",
+   "AMARK", "ARELEASE"
+} ;
+
+// message for array word w run with fewer than n cells
+//
+static string needs(int n, int w) {
+   static const char *cells[] = { "", "one parameter", "two parameters", "three parameters" } ;
+
+   return string("Need ") + cells[n] + " for " + arrayNames[w - OP_ARRAY] ;
+}
+
+
+// The word of cellOp() that array word w does to each cell:
+// + - * and the comparisons for the elementwise words, and
+// + < > for ASUM AMIN AMAX.
+//
+static constexpr int cellWord(int w) {
+   return (w >= OP_APLUS && w <= OP_ATIMES) ? OP_PLUS + (w - OP_APLUS)
+        : (w >= OP_ALT && w <= OP_AGT) ? OP_LT + (w - OP_ALT)
+        : (w == OP_ASUM) ? OP_PLUS
+        : (w == OP_AMIN) ? OP_LT
+        : OP_GT ;
+}
+
+
+// Kernels. A map kernel does a[i] = a[i] op b[i] for the n
+// cells of a, or a[i] op s if b is NULL. A reduce kernel
+// does op over the n cells of a; n is at least 1 for < and >.
+//
+typedef void (* map_fn)(cell_t *a, const cell_t *b, cell_t s, size_t n) ;
+typedef cell_t (* reduce_fn)(const cell_t *a, size_t n) ;
+
+
+template <int OP>
+static void mapScalar(cell_t *a, const cell_t *b, cell_t s, size_t n) {
+   cell_t r ;
+
+   for (size_t i = 0 ; i < n ; i++) {
+      cell_t y = b ? b[i] : s ;
+
+      if ( !cellOp<OP>(a[i], y, r) ) throw cellOpError(OP, y) ;
+      a[i] = r ;
+   }
+}
+
+
+// < keeps the least cell, > the greatest
+//
+template <int OP>
+static cell_t reduceScalar(const cell_t *a, size_t n) {
+   cell_t acc = (OP == OP_PLUS) ? 0 : a[0] ;
+   cell_t r ;
+
+   for (size_t i = 0 ; i < n ; i++) {
+      if ( OP == OP_PLUS ) {
+         if ( !cellOp<OP_PLUS>(acc, a[i], r) ) throw cellOpError(OP_PLUS, a[i]) ;
+         acc = r ;
+      } else {
+         cellOp<OP>(a[i], acc, r) ;
+         if ( r ) acc = a[i] ;
+      }
+   }
+   return acc ;
+}
+
+
+#ifdef SALLY_SIMD
+
+// The kernels on BYTES wide vectors, inlined into the ones
+// for each instruction set below. Arithmetic is done on
+// unsigned lanes, so that it wraps. The cells after the last
+// whole vector are left to the scalar kernels.
+//
+template <int OP, int BYTES>
+static inline __attribute__((always_inline))
+void mapVector(cell_t *a, const cell_t *b, cell_t s, size_t n) {
+   typedef cell_t V __attribute__((vector_size(BYTES))) ;
+   typedef ucell_t U __attribute__((vector_size(BYTES))) ;
+   const size_t lanes = BYTES / sizeof(cell_t) ;
+   size_t i ;
+   V x, y ;
+
+   y = (V) {} + s ;
+   for (i = 0 ; i + lanes <= n ; i += lanes) {
+      memcpy(&x, a + i, BYTES) ;
+      if ( b ) memcpy(&y, b + i, BYTES) ;
+
+      switch (OP) {
+      case OP_PLUS:   x = (V) ((U) x + (U) y) ; break ;
+      case OP_MINUS:  x = (V) ((U) x - (U) y) ; break ;
+      case OP_TIMES:  x = (V) ((U) x * (U) y) ; break ;
+      case OP_LT:     x = -(V) (x < y) ; break ;
+      case OP_LE:     x = -(V) (x <= y) ; break ;
+      case OP_EQ:     x = -(V) (x == y) ; break ;
+      case OP_NE:     x = -(V) (x != y) ; break ;
+      case OP_GE:     x = -(V) (x >= y) ; break ;
+      case OP_GT:     x = -(V) (x > y) ; break ;
+      }
+      memcpy(a + i, &x, BYTES) ;
+   }
+   mapScalar<OP>(a + i, b ? b + i : NULL, s, n - i) ;
+}
+
+
+template <int OP, int BYTES>
+static inline __attribute__((always_inline))
+cell_t reduceVector(const cell_t *a, size_t n) {
+   typedef cell_t V __attribute__((vector_size(BYTES))) ;
+   typedef ucell_t U __attribute__((vector_size(BYTES))) ;
+   const size_t lanes = BYTES / sizeof(cell_t) ;
+   cell_t rest[2 * lanes] ;
+   size_t i ;
+   V acc, x ;
+
+   if ( n < 2 * lanes ) {
+      return reduceScalar<OP>(a, n) ;
+   }
+   memcpy(&acc, a, BYTES) ;
+   for (i = lanes ; i + lanes <= n ; i += lanes) {
+      memcpy(&x, a + i, BYTES) ;
+
+      switch (OP) {
+      case OP_PLUS:   acc = (V) ((U) acc + (U) x) ; break ;
+      case OP_LT:     acc = (x < acc) ? x : acc ; break ;
+      case OP_GT:     acc = (x > acc) ? x : acc ; break ;
+      }
+   }
+
+   // the lanes, and the cells after them
+   //
+   memcpy(rest, &acc, BYTES) ;
+   memcpy(rest + lanes, a + i, (n - i) * sizeof(cell_t)) ;
+   return reduceScalar<OP>(rest, lanes + n - i) ;
+}
+
+
+template <int OP>
+__attribute__((target("avx2")))
+static void mapAVX2(cell_t *a, const cell_t *b, cell_t s, size_t n) {
+   mapVector<OP, 32>(a, b, s, n) ;
+}
+
+template <int OP>
+__attribute__((target("sse4.2")))
+static void mapSSE(cell_t *a, const cell_t *b, cell_t s, size_t n) {
+   mapVector<OP, 16>(a, b, s, n) ;
+}
+
+template <int OP>
+__attribute__((target("avx2")))
+static cell_t reduceAVX2(const cell_t *a, size_t n) {
+   return reduceVector<OP, 32>(a, n) ;
+}
+
+template <int OP>
+__attribute__((target("sse4.2")))
+static cell_t reduceSSE(const cell_t *a, size_t n) {
+   return reduceVector<OP, 16>(a, n) ;
+}
+
+
+// Can op use the vector kernels? Checked arithmetic is
+// always scalar.
+//
+static bool vectorOK(int op) {
+#ifdef SALLY_CHECKED_ARITH
+   return op != OP_PLUS && op != OP_MINUS && op != OP_TIMES ;
+#else
+   (void) op ;
+   return true ;
+#endif
+}
+
+#endif
+
+
+// The best kernels for OP that the CPU can run.
+//
+template <int OP>
+static map_fn pickMap() {
+#ifdef SALLY_SIMD
+   if ( vectorOK(OP) && __builtin_cpu_supports("avx2") ) return mapAVX2<OP> ;
+   if ( vectorOK(OP) && __builtin_cpu_supports("sse4.2") ) return mapSSE<OP> ;
+#endif
+   return mapScalar<OP> ;
+}
+
+template <int OP>
+static reduce_fn pickReduce() {
+#ifdef SALLY_SIMD
+   if ( vectorOK(OP) && __builtin_cpu_supports("avx2") ) return reduceAVX2<OP> ;
+   if ( vectorOK(OP) && __builtin_cpu_supports("sse4.2") ) return reduceSSE<OP> ;
+#endif
+   return reduceScalar<OP> ;
+}
+
+
+// Run the kernels for OP, picked the first time.
+//
+template <int OP>
+static void mapArray(cell_t *a, const cell_t *b, cell_t s, size_t n) {
+   static const map_fn kernel = pickMap<OP>() ;
+
+   kernel(a, b, s, n) ;
+}
+
+template <int OP>
+static cell_t reduceArray(const cell_t *a, size_t n) {
+   static const reduce_fn kernel = pickReduce<OP>() ;
+
+   return kernel(a, n) ;
+}
+
+
+// Add the array words to the symbol table. Called by the
+// constructor before it makes optab.
+//
+void Sally::arrayWords() {
+   symtab["ARRAY"] =  SymTabEntry(KEYWORD,0,&doARRAY,OP_ARRAY) ;
+   symtab["AFILL"] =  SymTabEntry(KEYWORD,0,&doAFILL,OP_AFILL) ;
+   symtab["ACOPY"] =  SymTabEntry(KEYWORD,0,&doACOPY,OP_ACOPY) ;
+   symtab["ALEN"] =  SymTabEntry(KEYWORD,0,&doALEN,OP_ALEN) ;
+   symtab["A@"] =  SymTabEntry(KEYWORD,0,&doAAT,OP_AAT) ;
+   symtab["A!"] =  SymTabEntry(KEYWORD,0,&doASTORE,OP_ASTORE) ;
+
+   symtab["A+"] =  SymTabEntry(KEYWORD,0,&doAMAP<OP_APLUS>,OP_APLUS) ;
+   symtab["A-"] =  SymTabEntry(KEYWORD,0,&doAMAP<OP_AMINUS>,OP_AMINUS) ;
+   symtab["A*"] =  SymTabEntry(KEYWORD,0,&doAMAP<OP_ATIMES>,OP_ATIMES) ;
+   symtab["A<"] =  SymTabEntry(KEYWORD,0,&doAMAP<OP_ALT>,OP_ALT) ;
+   symtab["A<="] =  SymTabEntry(KEYWORD,0,&doAMAP<OP_ALE>,OP_ALE) ;
+   symtab["A=="] =  SymTabEntry(KEYWORD,0,&doAMAP<OP_AEQ>,OP_AEQ) ;
+   symtab["A!="] =  SymTabEntry(KEYWORD,0,&doAMAP<OP_ANE>,OP_ANE) ;
+   symtab["A>="] =  SymTabEntry(KEYWORD,0,&doAMAP<OP_AGE>,OP_AGE) ;
+   symtab["A>"] =  SymTabEntry(KEYWORD,0,&doAMAP<OP_AGT>,OP_AGT) ;
+
+   symtab["ASUM"] =  SymTabEntry(KEYWORD,0,&doAREDUCE<OP_ASUM>,OP_ASUM) ;
+   symtab["AMIN"] =  SymTabEntry(KEYWORD,0,&doAREDUCE<OP_AMIN>,OP_AMIN) ;
+   symtab["AMAX"] =  SymTabEntry(KEYWORD,0,&doAREDUCE<OP_AMAX>,OP_AMAX) ;
+
+   symtab["AMARK"] =  SymTabEntry(KEYWORD,0,&doAMARK,OP_AMARK) ;
+   symtab["ARELEASE"] =  SymTabEntry(KEYWORD,0,&doARELEASE,OP_ARELEASE) ;
+}
+
+
+// The array of an ARRAY cell.
+//
+vector<cell_t>& Sally::arrayOf(const Cell& c) {
+   if ( c.m_kind != ARRAY ) {
+      throw ("Error! Not an array.") ;
+   }
+   if ( (size_t) c.m_value >= arrays.size() ) {
+      throw ("Error! Array has been released.") ;
+   }
+   return arrays[c.m_value] ;
+}
+
+
+// Counts n more cells in arrays, or throws if that would
+// be more than arrayLimit.
+//
+void Sally::arrayRoom(cell_t n) {
+   if ( (ucell_t) n > arrayLimit - arrayCells ) {
+      throw ("Error! Array space full.") ;
+   }
+   arrayCells += n ;
+}
+
+
+// The array words check everything before they pop
+// anything, so a word that fails leaves the stack alone.
+
+void Sally::doARRAY(Sally *Sptr) {
+   if ( Sptr->params.size() < 2 ) {
+      throw out_of_range( needs(2, OP_ARRAY) ) ;
+   }
+   cell_t v = Sptr->params.peek(0).m_value ;
+   cell_t n = Sptr->params.peek(1).m_value ;
+
+   if ( n < 0 ) {
+      throw ("Error! Array size must not be negative.") ;
+   }
+   Sptr->arrayRoom(n) ;
+   Sptr->arrays.push_back( vector<cell_t>(n, v) ) ;
+   Sptr->params.pop() ;
+   Sptr->params.pop() ;
+   Sptr->params.push( Cell(ARRAY, Sptr->arrays.size() - 1) ) ;
+}
+
+
+void Sally::doAFILL(Sally *Sptr) {
+   if ( Sptr->params.size() < 2 ) {
+      throw out_of_range( needs(2, OP_AFILL) ) ;
+   }
+   vector<cell_t>& a = Sptr->arrayOf( Sptr->params.peek(1) ) ;
+
+   a.assign(a.size(), Sptr->params.top().m_value) ;
+   Sptr->params.pop() ;
+}
+
+
+void Sally::doACOPY(Sally *Sptr) {
+   if ( Sptr->params.size() < 1 ) {
+      throw out_of_range( needs(1, OP_ACOPY) ) ;
+   }
+   Sptr->arrayOf( Sptr->params.top() ) ;      // or it throws
+   cell_t from = Sptr->params.top().m_value ;
+   Sptr->arrayRoom( Sptr->arrays[from].size() ) ;
+   Sptr->arrays.push_back( vector<cell_t>() ) ;
+   Sptr->arrays.back() = Sptr->arrays[from] ;
+   Sptr->params.top() = Cell(ARRAY, Sptr->arrays.size() - 1) ;
+}
+
+
+void Sally::doALEN(Sally *Sptr) {
+   if ( Sptr->params.size() < 1 ) {
+      throw out_of_range( needs(1, OP_ALEN) ) ;
+   }
+   vector<cell_t>& a = Sptr->arrayOf( Sptr->params.top() ) ;
+
+   Sptr->params.top() = Cell(INTEGER, a.size()) ;
+}
+
+
+void Sally::doAAT(Sally *Sptr) {
+   if ( Sptr->params.size() < 2 ) {
+      throw out_of_range( needs(2, OP_AAT) ) ;
+   }
+   vector<cell_t>& a = Sptr->arrayOf( Sptr->params.peek(1) ) ;
+   cell_t i = Sptr->params.top().m_value ;
+
+   if ( i < 0 || i >= (cell_t) a.size() ) {
+      throw ("Error! Array index out of range.") ;
+   }
+   Sptr->params.pop() ;
+   Sptr->params.top() = Cell(INTEGER, a[i]) ;
+}
+
+
+void Sally::doASTORE(Sally *Sptr) {
+   if ( Sptr->params.size() < 3 ) {
+      throw out_of_range( needs(3, OP_ASTORE) ) ;
+   }
+   vector<cell_t>& a = Sptr->arrayOf( Sptr->params.peek(1) ) ;
+   cell_t i = Sptr->params.top().m_value ;
+
+   if ( i < 0 || i >= (cell_t) a.size() ) {
+      throw ("Error! Array index out of range.") ;
+   }
+   a[i] = Sptr->params.peek(2).m_value ;
+   Sptr->params.pop() ;
+   Sptr->params.pop() ;
+   Sptr->params.pop() ;
+}
+
+
+// a b -- a, b being an array as long as a or a number
+//
+template <int W>
+void Sally::doAMAP(Sally *Sptr) {
+   if ( Sptr->params.size() < 2 ) {
+      throw out_of_range( needs(2, W) ) ;
+   }
+   vector<cell_t>& a = Sptr->arrayOf( Sptr->params.peek(1) ) ;
+   const Cell& b = Sptr->params.top() ;
+
+   if ( b.m_kind == ARRAY ) {
+      vector<cell_t>& bv = Sptr->arrayOf(b) ;
+
+      if ( bv.size() != a.size() ) {
+         throw ("Error! Arrays differ in length.") ;
+      }
+      mapArray<cellWord(W)>(a.data(), bv.data(), 0, a.size()) ;
+   } else {
+      mapArray<cellWord(W)>(a.data(), NULL, b.m_value, a.size()) ;
+   }
+   Sptr->params.pop() ;
+}
+
+
+// a -- x
+//
+template <int W>
+void Sally::doAREDUCE(Sally *Sptr) {
+   if ( Sptr->params.size() < 1 ) {
+      throw out_of_range( needs(1, W) ) ;
+   }
+   vector<cell_t>& a = Sptr->arrayOf( Sptr->params.top() ) ;
+   cell_t x = 0 ;
+
+   if ( !a.empty() ) {
+      x = reduceArray<cellWord(W)>(a.data(), a.size()) ;
+   } else if ( W != OP_ASUM ) {
+      throw ("Error! Array is empty.") ;
+   }
+   Sptr->params.top() = Cell(INTEGER, x) ;
+}
+
+
+// -- m
+//
+void Sally::doAMARK(Sally *Sptr) {
+   Sptr->params.push( Cell(INTEGER, Sptr->arrays.size()) ) ;
+}
+
+
+// m -- ; frees every array made since AMARK left m. The
+// memory goes back at once
+//
+void Sally::doARELEASE(Sally *Sptr) {
+   if ( Sptr->params.size() < 1 ) {
+      throw out_of_range( needs(1, OP_ARELEASE) ) ;
+   }
+   cell_t mark = Sptr->params.top().m_value ;
+
+   if ( mark < 0 || (size_t) mark > Sptr->arrays.size() ) {
+      throw ("Error! No such array mark.") ;
+   }
+   for (size_t i = mark ; i < Sptr->arrays.size() ; i++) {
+      Sptr->arrayCells -= Sptr->arrays[i].size() ;
+   }
+   Sptr->arrays.resize(mark) ;
+   Sptr->params.pop() ;
+}
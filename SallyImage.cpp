@@ -0,0 +1,409 @@
+// File: SallyImage.cpp
+//
+//
+// Compiled program images (.sallyc) of the Sally Forth interpreter
+//
+// With SallyOptions::m_imageCache on, loadFile() looks for
+// prog.sallyc next to prog.sally. An image holds everything
+// compile() made of the file: the code, the colon definitions
+// in dict, the string pool and the variable slots. When the
+// image is good the program starts running without being
+// lexed or compiled.
+//
+// An image is only used if it was made from the same source
+// (same size and FNV-1a hash) by an interpreter with the same
+// SALLY_IMAGE_VERSION, cell width and compile options, and
+// if the checksum of everything after its header is right.
+// Anything else is treated as no image: the source is
+// compiled and the image written again.
+//
+// Layout, in the byte order of the machine. Everything but
+// the header and the chars is cells (cell_t), so literals
+// keep all their bits:
+//
+//    ImageHeader
+//    code      m_code records of 3 cells: opcode, arg, line
+//    dict      m_dict records, the same
+//    defs      m_defs pairs of cells: name handle, body in dict
+//    slots     m_slots cells: pool handle of each variable name
+//    strings   m_strings cells: length of each pool string,
+//              then the chars of all of them
+//
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+using namespace std ;
+
+#include "Sally.h"
+
+
+static const char imageMagic[8] = { 'S', 'A', 'L', 'L', 'Y', 'C', '\n', 0 } ;
+
+
+// first thing in an image file
+//
+struct ImageHeader {
+   char m_magic[8] ;
+   int m_version ;                    // SALLY_IMAGE_VERSION
+   int m_opCount ;                    // OP_COUNT
+   int m_cellBits ;                   // SALLY_CELL_BITS
+   int m_optimize ;                   // compile options used
+   int m_inlineLimit ;
+   unsigned long long m_sourceHash ;
+   long long m_sourceSize ;
+   int m_code ;                       // # of instructions
+   int m_dict ;
+   int m_defs ;                       // # of colon definitions
+   int m_slots ;                      // # of variables
+   int m_strings ;                    // # of strings in the pool
+   int m_fusions[FUSE_COUNT] ;        // for the fusion report
+   long long m_chars ;                // chars of all the strings
+   unsigned long long m_checksum ;    // of everything after this
+} ;
+
+
+// FNV-1a hash of len bytes at s, going on from hash h
+//
+static unsigned long long fnv64(const void *s, size_t len,
+                                unsigned long long h = 14695981039346656037ULL) {
+   const unsigned char *p = (const unsigned char *) s ;
+
+   for (size_t i = 0 ; i < len ; i++) {
+      h ^= p[i] ;
+      h *= 1099511628211ULL ;
+   }
+   return h ;
+}
+
+
+// prog.sally -> prog.sallyc, anything else gets .sallyc added
+//
+static string imageName(const char *path) {
+   string name = path ;
+   size_t n = name.size() ;
+
+   if ( n >= 6 && name.compare(n - 6, 6, ".sally") == 0 ) {
+      return name + "c" ;
+   }
+   return name + ".sallyc" ;
+}
+
+
+// write len bytes at s to fd. false if they did not all go
+//
+static bool writeAll(int fd, const char *s, size_t len) {
+   while ( len > 0 ) {
+      ssize_t n = write(fd, s, len) ;
+      if ( n <= 0 ) return false ;
+      s += n ;
+      len -= n ;
+   }
+   return true ;
+}
+
+
+// Opcodes run() does itself. The others are run by their
+// builtins in optab.
+//
+static bool runsInline(cell_t op) {
+   switch (op) {
+   case OP_NOP: case OP_HALT: case OP_INT: case OP_STR: case OP_NAME:
+   case OP_IFTHEN: case OP_ELSE: case OP_UNTIL:
+   case OP_VARAT: case OP_VARSTORE: case OP_VARSET:
+   case OP_CALL: case OP_EXIT:
+   case OP_ADDI: case OP_SQUARE: case OP_NIP: case OP_VARADD:
+   case OP_IFLT: case OP_IFLE: case OP_IFEQ:
+   case OP_IFNE: case OP_IFGE: case OP_IFGT:
+      return true ;
+   default:
+      return false ;
+   }
+}
+
+
+// Are the n instruction records at rec ones the interpreter
+// can run without falling off the end, indexing past a table
+// or calling a builtin it does not have? Code must end in
+// OP_HALT and dict in OP_EXIT. OP_DATA is only good right
+// after OP_VARADD, and nothing may branch to it.
+//
+static bool goodCode(const cell_t *rec, int n, const ImageHeader& h, OpCode last,
+                     const vector<operation_t>& optab) {
+
+   if ( n > 0 && rec[3 * (n - 1)] != last ) return false ;
+   if ( n == 0 && last == OP_HALT ) return false ;
+
+   for (int i = 0 ; i < n ; i++) {
+      cell_t op = rec[3 * i], arg = rec[3 * i + 1] ;
+
+      // OP_JITUNTIL only exists while code runs
+      //
+      if ( op < 0 || op >= OP_COUNT || op == OP_JITUNTIL ) return false ;
+
+      if ( op == OP_DATA ) {
+         if ( i == 0 || rec[3 * (i - 1)] != OP_VARADD ) return false ;
+      } else if ( !runsInline(op) && optab[op] == NULL ) {
+         return false ;
+      }
+
+      if ( isBranch(OpCode(op)) ) {
+         if ( i + arg < 0 || i + arg >= n ) return false ;
+         if ( rec[3 * (i + arg)] == OP_DATA ) return false ;
+      }
+      switch (op) {
+      case OP_CALL:
+         if ( arg < 0 || arg >= h.m_dict ) return false ;
+         break ;
+      case OP_STR:
+         if ( arg < 0 || arg >= h.m_strings ) return false ;
+         break ;
+      case OP_VARADD:
+         if ( i + 1 >= n || rec[3 * (i + 1)] != OP_DATA ) return false ;
+         // and a slot, like these
+         // fallthrough
+      case OP_NAME: case OP_VARAT: case OP_VARSTORE: case OP_VARSET:
+         if ( arg < 0 || arg >= h.m_slots ) return false ;
+         break ;
+      default:
+         break ;
+      }
+   }
+   return true ;
+}
+
+
+// Called by loadFile() with the mapped source. Hashes it and
+// loads its image if there is a good one; if not, the image
+// is written once the source is compiled.
+//
+bool Sally::findImage(const char *path, const char *src, long len) {
+
+   // only a fresh interpreter can take an image: its
+   // handles, slots and dict positions are the image's
+   //
+   if ( !dict.empty() || !varNames.empty() ) {
+      return false ;
+   }
+
+   sourceHash = fnv64(src, len) ;
+   sourceSize = len ;
+   imagePath = imageName(path) ;
+
+   if ( loadImage(imagePath) ) {
+      imagePath.clear() ;
+      codeReady = true ;
+      return true ;
+   }
+   return false ;
+}
+
+
+// Load the image at path. Everything is checked before
+// anything is changed.
+//
+bool Sally::loadImage(const string& path) {
+   struct stat st ;
+   int fd = open(path.c_str(), O_RDONLY) ;
+
+   if ( fd < 0 ) {
+      return false ;
+   }
+   if ( fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(ImageHeader) ) {
+      close(fd) ;
+      return false ;
+   }
+
+   void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) ;
+   close(fd) ;
+   if ( map == MAP_FAILED ) {
+      return false ;
+   }
+
+   ImageHeader h ;
+   memcpy(&h, map, sizeof(h)) ;
+
+   const char *body = (const char *) map + sizeof(h) ;
+   long long bodySize = st.st_size - sizeof(h) ;
+   long long cells = 3LL * h.m_code + 3LL * h.m_dict + 2LL * h.m_defs
+                    + h.m_slots + h.m_strings ;
+
+   bool ok = memcmp(h.m_magic, imageMagic, sizeof(imageMagic)) == 0
+             && h.m_version == SALLY_IMAGE_VERSION
+             && h.m_opCount == OP_COUNT
+             && h.m_cellBits == SALLY_CELL_BITS
+             && h.m_optimize == optimizeOn
+             && h.m_inlineLimit == inlineLimit
+             && h.m_sourceHash == sourceHash
+             && h.m_sourceSize == sourceSize
+             && h.m_code >= 0 && h.m_dict >= 0 && h.m_defs >= 0
+             && h.m_slots >= 0 && h.m_strings >= pool.size()
+             && h.m_chars >= 0
+             && bodySize == cells * (long long) sizeof(cell_t) + h.m_chars
+             && fnv64(body, bodySize) == h.m_checksum ;
+
+   if ( !ok || cells == 0 ) {
+      munmap(map, st.st_size) ;
+      return false ;
+   }
+
+   // the cells are copied out, as the body after the
+   // header need not be aligned for them
+   //
+   vector<cell_t> v(cells) ;
+   memcpy(&v[0], body, cells * sizeof(cell_t)) ;
+
+   const cell_t *code_rec = &v[0] ;
+   const cell_t *dict_rec = code_rec + 3 * h.m_code ;
+   const cell_t *defs = dict_rec + 3 * h.m_dict ;
+   const cell_t *slots = defs + 2 * h.m_defs ;
+   const cell_t *lengths = slots + h.m_slots ;
+   const char *chars = body + cells * sizeof(cell_t) ;
+   int i ;
+
+   ok = goodCode(code_rec, h.m_code, h, OP_HALT, optab)
+        && goodCode(dict_rec, h.m_dict, h, OP_EXIT, optab) ;
+
+   for (i = 0 ; ok && i < h.m_defs ; i++) {
+      ok = defs[2*i] >= 0 && defs[2*i] < h.m_strings
+           && defs[2*i+1] >= 0 && defs[2*i+1] < h.m_dict ;
+   }
+   for (i = 0 ; ok && i < h.m_slots ; i++) {
+      ok = slots[i] >= 0 && slots[i] < h.m_strings ;
+   }
+
+   // the strings must add up, and the ones already in the
+   // pool (the keywords) must be where the image has them
+   //
+   long long at = 0 ;
+   for (i = 0 ; ok && i < h.m_strings ; i++) {
+      ok = lengths[i] >= 0 && at + lengths[i] <= h.m_chars ;
+      if ( ok && i < pool.size() ) {
+         ok = pool[i].compare(0, string::npos, chars + at, lengths[i]) == 0 ;
+      }
+      at += ok ? lengths[i] : 0 ;
+   }
+   ok = ok && at == h.m_chars ;
+
+   if ( !ok ) {
+      munmap(map, st.st_size) ;
+      return false ;
+   }
+
+   // good: take it
+   //
+   at = 0 ;
+   for (i = 0 ; i < h.m_strings ; i++) {
+      pool.intern(chars + at, lengths[i]) ;
+      at += lengths[i] ;
+   }
+   for (i = 0 ; i < h.m_slots ; i++) {
+      varSlot(slots[i]) ;
+   }
+
+   code.resize(h.m_code) ;
+   for (i = 0 ; i < h.m_code ; i++) {
+      code[i] = Instr( OpCode(code_rec[3*i]), code_rec[3*i+1], code_rec[3*i+2] ) ;
+   }
+   dict.resize(h.m_dict) ;
+   for (i = 0 ; i < h.m_dict ; i++) {
+      dict[i] = Instr( OpCode(dict_rec[3*i]), dict_rec[3*i+1], dict_rec[3*i+2] ) ;
+   }
+   for (i = 0 ; i < h.m_defs ; i++) {
+      enterDefinition(defs[2*i], defs[2*i+1]) ;
+   }
+   for (i = 0 ; i < FUSE_COUNT ; i++) {
+      fusions[i] += h.m_fusions[i] ;
+   }
+
+   munmap(map, st.st_size) ;
+   return true ;
+}
+
+
+// Write the image of what was just compiled to imagePath.
+// It is written to a new file that then takes the place of
+// the old one, so nobody ever reads half an image. If it
+// can not be written there is just no image.
+//
+void Sally::saveImage() {
+   ImageHeader h ;
+   vector<cell_t> v ;
+   string chars ;
+   int i ;
+
+   memset(&h, 0, sizeof(h)) ;
+   memcpy(h.m_magic, imageMagic, sizeof(imageMagic)) ;
+   h.m_version = SALLY_IMAGE_VERSION ;
+   h.m_opCount = OP_COUNT ;
+   h.m_cellBits = SALLY_CELL_BITS ;
+   h.m_optimize = optimizeOn ;
+   h.m_inlineLimit = inlineLimit ;
+   h.m_sourceHash = sourceHash ;
+   h.m_sourceSize = sourceSize ;
+
+   for (i = 0 ; i < (int) code.size() ; i++) {
+      v.push_back(code[i].m_op) ;
+      v.push_back(code[i].m_arg) ;
+      v.push_back(code[i].m_line) ;
+   }
+   h.m_code = code.size() ;
+
+   for (i = 0 ; i < (int) dict.size() ; i++) {
+      v.push_back(dict[i].m_op) ;
+      v.push_back(dict[i].m_arg) ;
+      v.push_back(dict[i].m_line) ;
+   }
+   h.m_dict = dict.size() ;
+
+   map<string,SymTabEntry>::iterator it ;
+   for (it = symtab.begin() ; it != symtab.end() ; it++) {
+      if ( it->second.m_opcode == OP_CALL ) {
+         v.push_back( pool.intern(it->first) ) ;
+         v.push_back( it->second.m_value ) ;
+         h.m_defs++ ;
+      }
+   }
+
+   v.insert( v.end(), varNames.begin(), varNames.end() ) ;
+   h.m_slots = varNames.size() ;
+
+   for (i = 0 ; i < pool.size() ; i++) {
+      v.push_back( pool[i].size() ) ;
+      chars += pool[i] ;
+   }
+   h.m_strings = pool.size() ;
+   h.m_chars = chars.size() ;
+
+   for (i = 0 ; i < FUSE_COUNT ; i++) {
+      h.m_fusions[i] = fusions[i] ;
+   }
+
+   const char *cells = v.empty() ? "" : (const char *) &v[0] ;
+   h.m_checksum = fnv64(chars.data(), chars.size(),
+                        fnv64(cells, v.size() * sizeof(cell_t))) ;
+
+   // a name of its own, as other interpreters in this or
+   // another process may be writing the same image
+   //
+   string tmp = imagePath + ".XXXXXX" ;
+   int fd = mkstemp(&tmp[0]) ;
+
+   if ( fd >= 0 ) {
+      bool ok = fchmod(fd, 0644) == 0
+                && writeAll(fd, (const char *) &h, sizeof(h))
+                && writeAll(fd, cells, v.size() * sizeof(cell_t))
+                && writeAll(fd, chars.data(), chars.size()) ;
+
+      if ( close(fd) != 0 || !ok || rename(tmp.c_str(), imagePath.c_str()) != 0 ) {
+         unlink(tmp.c_str()) ;
+      }
+   }
+   imagePath.clear() ;
+}
@@ -0,0 +1,673 @@
+// File: SallyJit.cpp
+//
+//
+// Native code for hot loops of the Sally Forth interpreter
+//
+// With SallyOptions::m_jit on, execute() turns every UNTIL
+// into an OP_JITUNTIL that counts the times its loop goes
+// round. When a loop has gone round m_jitThreshold times its
+// body is compiled to x86-64 code, and the loop runs in that
+// from then on. There is no JIT on other machines; the loops
+// are only counted.
+//
+// Only loops of integer words are compiled: numbers, + - *
+// / % NEG, the comparisons, AND OR NOT, DUP DROP SWAP ROT,
+// @ and ! of variables that are SET, and IFTHEN ELSE. Each
+// cell the body pushes is kept in a register of its own. The
+// body must leave the stack as deep as it found it and never
+// take more than it pushed, so native code never touches the
+// parameter stack. Loops with anything else are left to the
+// interpreter.
+//
+// Native code gives back to the interpreter through an exit:
+// it spills the cells it holds to jitSpill and returns the
+// number of the exit, and the interpreter pushes the cells
+// and goes on at the word the exit is for. Leaving the loop
+// is one exit. A / or % by 0 is another, so the interpreter
+// runs the word and reports the error as usual; so is an
+// overflow when built with SALLY_CHECKED_ARITH.
+//
+// Arithmetic is done in the width of a cell and goes by
+// cellOp(), as the interpreter's does.
+//
+
+#include <iostream>
+#include <vector>
+#include <cstring>
+#if defined(__x86_64__) && defined(__linux__)
+#include <sys/mman.h>
+#include <unistd.h>
+#define SALLY_JIT
+#endif
+using namespace std ;
+
+#include "Sally.h"
+
+
+// A loop not seen yet; offset is its UNTIL's m_arg.
+//
+JitLoop::JitLoop(int offset) {
+   m_offset = offset ;
+   m_count = 0 ;
+   m_failed = false ;
+   m_native = NULL ;
+   m_mem = NULL ;
+   m_memSize = 0 ;
+}
+
+
+// Number the UNTIL at in, if it is one, as a new loop.
+//
+static void countLoop(vector<JitLoop>& loops, Instr& in) {
+   if ( in.m_op == OP_UNTIL ) {
+      loops.push_back( JitLoop(in.m_arg) ) ;
+      in.m_op = OP_JITUNTIL ;
+      in.m_arg = loops.size() - 1 ;
+   }
+}
+
+
+// Called as execute() starts on a unit. The loops of the
+// last unit are gone; those of new definitions and of this
+// unit are counted from now on.
+//
+void Sally::jitPrepare() {
+   jitRelease(jitDictLoops) ;
+
+   for ( ; dictJitted < dict.size() ; dictJitted++) {
+      countLoop(jitLoops, dict[dictJitted]) ;
+   }
+   jitDictLoops = jitLoops.size() ;
+
+   for (size_t i = 0 ; i < code.size() ; i++) {
+      countLoop(jitLoops, code[i]) ;
+   }
+}
+
+
+// Drop the loops from jitLoops[from] on, and their code.
+//
+void Sally::jitRelease(size_t from) {
+   for (size_t i = from ; i < jitLoops.size() ; i++) {
+#ifdef SALLY_JIT
+      if ( jitLoops[i].m_mem != NULL ) {
+         munmap(jitLoops[i].m_mem, jitLoops[i].m_memSize) ;
+      }
+#endif
+   }
+   if ( from < jitLoops.size() ) {
+      jitLoops.erase(jitLoops.begin() + from, jitLoops.end()) ;
+   }
+}
+
+
+// The OP_JITUNTIL at in goes round again. Count it, and
+// compile the loop once it is hot; if it is compiled, run
+// it until it is done or gives up.
+//
+const Instr *Sally::jitLoop(const Instr *in) {
+   JitLoop& loop = jitLoops[in->m_arg] ;
+
+   if ( loop.m_native == NULL ) {
+      if ( loop.m_failed || ++loop.m_count < jitThreshold ) {
+         return in + loop.m_offset ;
+      }
+      if ( !jitCompile(loop, in) ) {
+         loop.m_failed = true ;
+         return in + loop.m_offset ;
+      }
+      jitCompiled++ ;
+   }
+
+   int k = loop.m_native(vars.data(), jitSpill) ;
+   const JitExit& e = loop.m_exits[k] ;
+
+   for (int i = 0 ; i < e.m_depth ; i++) {
+      params.push( Cell(INTEGER, jitSpill[i]) ) ;
+   }
+   return in + e.m_resume ;
+}
+
+
+#ifdef SALLY_JIT
+
+// x86-64 registers, by their number in instructions
+//
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+       R8, R9, R10, R11, R12, R13, R14, R15 } ;
+
+
+// condition codes of jcc and setcc. flipping the low bit
+// gives the opposite condition
+//
+enum { CC_O = 0x0, CC_E = 0x4, CC_NE = 0x5, CC_L = 0xC, CC_GE = 0xD,
+       CC_LE = 0xE, CC_G = 0xF } ;
+
+static const int compareCC[6] = { CC_L, CC_LE, CC_E, CC_NE, CC_GE, CC_G } ;
+
+
+// The cells the body pushes, bottom first. rdi holds the
+// variables and rsi the spill area, as they were passed;
+// rax, rcx and rdx are scratch, and idiv's.
+//
+static const int cellReg[SALLY_JIT_CELLS] = {
+   R8, R9, R10, R11, RBX, R12, R13, R14, R15
+} ;
+
+// callee saved registers among them
+//
+static const int savedReg[5] = { RBX, R12, R13, R14, R15 } ;
+
+
+// REX.W, for operands as wide as a cell
+//
+static const int REX_W = (SALLY_CELL_BITS == 64) ? 8 : 0 ;
+
+
+// true if v can be an instruction's 32 bit immediate
+//
+static bool fitsImm(cell_t v) {
+   return v == (int) v ;
+}
+
+
+// Machine code being put together. Operands are as wide
+// as the cells.
+//
+class Emitter {
+
+public:
+
+   vector<unsigned char> m_code ;
+
+   int pos() const { return m_code.size() ; }
+   void byte(int b) { m_code.push_back(b) ; }
+
+   void word(int w) {
+      for (int i = 0 ; i < 4 ; i++) byte( (unsigned) w >> (8 * i) ) ;
+   }
+
+   // point the rel32 at at to target
+   //
+   void patch(int at, int target) {
+      int rel = target - (at + 4) ;
+      memcpy(&m_code[at], &rel, 4) ;
+   }
+
+   void rex(int reg, int rm, int w = REX_W) {
+      if ( w || reg >= 8 || rm >= 8 ) byte( 0x40 | w | (reg >> 3) << 2 | (rm >> 3) ) ;
+   }
+
+   void modrm(int mod, int reg, int rm) {
+      byte( mod << 6 | (reg & 7) << 3 | (rm & 7) ) ;
+   }
+
+   // op r/m, reg: add 01, sub 29, cmp 39, test 85, mov 89
+   //
+   void rr(int op, int reg, int rm) {
+      rex(reg, rm) ;
+      byte(op) ;
+      modrm(3, reg, rm) ;
+   }
+
+   void mov(int dst, int src) {
+      if ( dst != src ) rr(0x89, src, dst) ;
+   }
+
+   // C7 /0 takes 32 bits, sign extended; B8 all 64
+   //
+   void movImm(int dst, cell_t v) {
+      if ( REX_W && fitsImm(v) ) {
+         rex(0, dst) ;
+         byte(0xC7) ;
+         modrm(3, 0, dst) ;
+         word(v) ;
+      } else {
+         rex(0, dst) ;
+         byte(0xB8 + (dst & 7)) ;
+         word(v) ;
+         if ( REX_W ) word( (ucell_t) v >> 16 >> 16 ) ;
+      }
+   }
+
+   // 81 /ext: add 0, cmp 7. v must fit
+   //
+   void aluImm(int ext, int dst, int v) {
+      rex(0, dst) ;
+      byte(0x81) ;
+      modrm(3, ext, dst) ;
+      word(v) ;
+   }
+
+   // F7 /ext: neg 3, idiv 7
+   //
+   void unary(int ext, int dst) {
+      rex(0, dst) ;
+      byte(0xF7) ;
+      modrm(3, ext, dst) ;
+   }
+
+   void imul(int dst, int src) {
+      rex(dst, src) ;
+      byte(0x0F) ; byte(0xAF) ;
+      modrm(3, dst, src) ;
+   }
+
+   // [base + disp], base being rdi or rsi
+   //
+   void load(int dst, int base, int disp) {
+      rex(dst, base) ;
+      byte(0x8B) ;
+      modrm(2, dst, base) ;
+      word(disp) ;
+   }
+
+   void store(int base, int disp, int src) {
+      rex(src, base) ;
+      byte(0x89) ;
+      modrm(2, src, base) ;
+      word(disp) ;
+   }
+
+   // setcc al, or cl
+   //
+   void setcc(int cc, int reg8) {
+      byte(0x0F) ; byte(0x90 | cc) ;
+      modrm(3, 0, reg8) ;
+   }
+
+   // dst = al, zero extended
+   //
+   void fromAL(int dst) {
+      byte(0x0F) ; byte(0xB6) ; byte(0xC0) ;
+      mov(dst, RAX) ;
+   }
+
+   // jumps; they return where the rel32 is, to patch
+   //
+   int jcc(int cc) {
+      byte(0x0F) ; byte(0x80 | cc) ;
+      word(0) ;
+      return pos() - 4 ;
+   }
+
+   int jmp() {
+      byte(0xE9) ;
+      word(0) ;
+      return pos() - 4 ;
+   }
+
+   // cdq, or cqo: sign extend rax into rdx for idiv
+   //
+   void signExtend() {
+      rex(0, 0) ;
+      byte(0x99) ;
+   }
+
+   void push(int r) { rex(0, r, 0) ; byte(0x50 + (r & 7)) ; }
+   void pop(int r) { rex(0, r, 0) ; byte(0x58 + (r & 7)) ; }
+
+   // return exit k of the loop
+   //
+   void leave(int k) {
+      movImm(RAX, k) ;
+      for (int i = 4 ; i >= 0 ; i--) pop(savedReg[i]) ;
+      byte(0xC3) ;
+   }
+
+} ;
+
+
+// an exit not yet written: the jump to it, and its number
+//
+struct PendingExit {
+   int m_jump ;
+   int m_exit ;
+} ;
+
+
+// Compile the loop ending in the OP_JITUNTIL at until.
+// False if it has something that can't be compiled.
+//
+// Each word is compiled knowing how many cells the body has
+// pushed before it runs. That must be the same however it is
+// reached, which holds for IFTHEN ELSE ENDIF unless a branch
+// pushes more than the other.
+//
+bool Sally::jitCompile(JitLoop& loop, const Instr *until) {
+   const Instr *body = until + loop.m_offset ;
+   int n = 1 - loop.m_offset ;           // words of the loop, UNTIL last
+   vector<int> depth(n, -1) ;            // cells pushed before each word
+   vector<int> start(n, 0) ;             // where its code starts
+   vector< pair<int,int> > jumps ;       // jump and the word it goes to
+   vector<PendingExit> exits ;
+   Emitter e ;
+   int d, to ;
+
+   loop.m_exits.clear() ;
+   for (int i = 0 ; i < 5 ; i++) e.push(savedReg[i]) ;
+   depth[0] = 0 ;
+
+   // the k-th cell from the top, and room checks
+   //
+#define R(k)     cellReg[d - 1 - (k)]
+#define NEED(k)  if ( d < (k) ) return false
+#define ROOM     if ( d == SALLY_JIT_CELLS ) return false
+#define SETVAR   if ( in.m_arg >= (int) vars.size() || !varIsSet[in.m_arg] ) return false
+#define VAR      (int) sizeof(cell_t) * (int) in.m_arg
+
+   // leave to the interpreter at word i, holding d cells,
+   // if the flags say cc
+   //
+   auto sideExit = [&](int i, int cc) {
+      JitExit x = { i - (n - 1), d } ;
+      PendingExit p = { e.jcc(cc), (int) loop.m_exits.size() } ;
+
+      exits.push_back(p) ;
+      loop.m_exits.push_back(x) ;
+   } ;
+
+   // arithmetic is done in rax, so that the operands are
+   // still there to spill when it overflows
+   //
+#ifdef SALLY_CHECKED_ARITH
+#define OVERFLOW sideExit(i, CC_O)
+#else
+#define OVERFLOW
+#endif
+
+   // the word at to is reached with d cells; to must be
+   // after word i
+   //
+#define REACH(i, to) \
+      if ( (to) <= (i) || (to) >= n ) return false ; \
+      if ( depth[to] < 0 ) depth[to] = d ; \
+      if ( depth[to] != d ) return false
+
+   for (int i = 0 ; i < n ; i++) {
+      const Instr& in = body[i] ;
+
+      start[i] = e.pos() ;
+      d = depth[i] ;
+      if ( d < 0 ) {
+         if ( i == n - 1 ) return false ;
+         continue ;              // only reached by jumping past it
+      }
+
+      switch (in.m_op) {
+
+      case OP_NOP:
+         break ;
+
+      case OP_INT:
+         ROOM ;
+         e.movImm(cellReg[d++], in.m_arg) ;
+         break ;
+
+      case OP_VARAT:
+         SETVAR ;
+         ROOM ;
+         e.load(cellReg[d++], RDI, VAR) ;
+         break ;
+
+      case OP_VARSTORE:
+         SETVAR ;
+         NEED(1) ;
+         e.store(RDI, VAR, R(0)) ;
+         d-- ;
+         break ;
+
+      case OP_VARADD:
+         SETVAR ;
+         if ( i + 1 >= n - 1 || !fitsImm(body[i + 1].m_arg) ) return false ;
+         e.load(RAX, RDI, VAR) ;
+         e.aluImm(0, RAX, body[i + 1].m_arg) ;
+         OVERFLOW ;
+         e.store(RDI, VAR, RAX) ;
+         start[++i] = e.pos() ;
+         break ;
+
+      case OP_PLUS:
+         NEED(2) ;
+         e.mov(RAX, R(1)) ;
+         e.rr(0x01, R(0), RAX) ;
+         OVERFLOW ;
+         e.mov(R(1), RAX) ;
+         d-- ;
+         break ;
+
+      case OP_MINUS:
+         NEED(2) ;
+         e.mov(RAX, R(1)) ;
+         e.rr(0x29, R(0), RAX) ;
+         OVERFLOW ;
+         e.mov(R(1), RAX) ;
+         d-- ;
+         break ;
+
+      case OP_TIMES:
+         NEED(2) ;
+         e.mov(RAX, R(1)) ;
+         e.imul(RAX, R(0)) ;
+         OVERFLOW ;
+         e.mov(R(1), RAX) ;
+         d-- ;
+         break ;
+
+      // 0 is left to the interpreter; -1 is a NEG or a 0,
+      // as idiv would trap on CELL_MIN
+      //
+      case OP_DIVIDE:
+      case OP_MOD: {
+         NEED(2) ;
+         e.rr(0x85, R(0), R(0)) ;
+         sideExit(i, CC_E) ;
+
+         e.aluImm(7, R(0), -1) ;
+         int divide = e.jcc(CC_NE) ;
+         if ( in.m_op == OP_DIVIDE ) {
+            e.mov(RAX, R(1)) ;
+            e.unary(3, RAX) ;
+            OVERFLOW ;
+            e.mov(R(1), RAX) ;
+         } else {
+            e.movImm(R(1), 0) ;
+         }
+         int done = e.jmp() ;
+         e.patch(divide, e.pos()) ;
+         e.mov(RAX, R(1)) ;
+         e.signExtend() ;
+         e.unary(7, R(0)) ;
+         e.mov(R(1), in.m_op == OP_DIVIDE ? RAX : RDX) ;
+         e.patch(done, e.pos()) ;
+         d-- ;
+         break ;
+      }
+
+      case OP_NEG:
+         NEED(1) ;
+         e.mov(RAX, R(0)) ;
+         e.unary(3, RAX) ;
+         OVERFLOW ;
+         e.mov(R(0), RAX) ;
+         break ;
+
+      case OP_ADDI:
+         NEED(1) ;
+         e.mov(RAX, R(0)) ;
+         if ( fitsImm(in.m_arg) ) {
+            e.aluImm(0, RAX, in.m_arg) ;
+         } else {
+            e.movImm(RCX, in.m_arg) ;
+            e.rr(0x01, RCX, RAX) ;
+         }
+         OVERFLOW ;
+         e.mov(R(0), RAX) ;
+         break ;
+
+      case OP_SQUARE:
+         NEED(1) ;
+         e.mov(RAX, R(0)) ;
+         e.imul(RAX, RAX) ;
+         OVERFLOW ;
+         e.mov(R(0), RAX) ;
+         break ;
+
+      case OP_DUP:
+         NEED(1) ;
+         ROOM ;
+         e.mov(cellReg[d], R(0)) ;
+         d++ ;
+         break ;
+
+      case OP_DROP:
+         NEED(1) ;
+         d-- ;
+         break ;
+
+      case OP_NIP:
+         NEED(2) ;
+         e.mov(R(1), R(0)) ;
+         d-- ;
+         break ;
+
+      case OP_SWAP:
+         NEED(2) ;
+         e.mov(RAX, R(0)) ;
+         e.mov(R(0), R(1)) ;
+         e.mov(R(1), RAX) ;
+         break ;
+
+      case OP_ROT:
+         NEED(3) ;
+         e.mov(RAX, R(2)) ;
+         e.mov(R(2), R(1)) ;
+         e.mov(R(1), R(0)) ;
+         e.mov(R(0), RAX) ;
+         break ;
+
+      case OP_LT: case OP_LE: case OP_EQ:
+      case OP_NE: case OP_GE: case OP_GT:
+         NEED(2) ;
+         e.rr(0x39, R(0), R(1)) ;
+         e.setcc(compareCC[in.m_op - OP_LT], RAX) ;
+         e.fromAL(R(1)) ;
+         d-- ;
+         break ;
+
+      case OP_AND:
+      case OP_OR:
+         NEED(2) ;
+         e.aluImm(7, R(1), 1) ;
+         e.setcc(CC_E, RAX) ;
+         e.aluImm(7, R(0), 1) ;
+         e.setcc(CC_E, RCX) ;
+         e.byte(in.m_op == OP_AND ? 0x20 : 0x08) ;   // and/or al, cl
+         e.byte(0xC8) ;
+         e.fromAL(R(1)) ;
+         d-- ;
+         break ;
+
+      case OP_NOT:
+         NEED(1) ;
+         e.rr(0x85, R(0), R(0)) ;
+         e.setcc(CC_E, RAX) ;
+         e.fromAL(R(0)) ;
+         break ;
+
+      case OP_IFTHEN:
+         NEED(1) ;
+         e.aluImm(7, R(0), 1) ;
+         d-- ;
+         to = i + in.m_arg ;
+         REACH(i, to) ;
+         jumps.push_back( make_pair(e.jcc(CC_NE), to) ) ;
+         break ;
+
+      case OP_IFLT: case OP_IFLE: case OP_IFEQ:
+      case OP_IFNE: case OP_IFGE: case OP_IFGT:
+         NEED(2) ;
+         e.rr(0x39, R(0), R(1)) ;
+         d -= 2 ;
+         to = i + in.m_arg ;
+         REACH(i, to) ;
+         jumps.push_back( make_pair(e.jcc(compareCC[in.m_op - OP_IFLT] ^ 1), to) ) ;
+         break ;
+
+      case OP_ELSE:
+         to = i + in.m_arg ;
+         REACH(i, to) ;
+         jumps.push_back( make_pair(e.jmp(), to) ) ;
+         continue ;               // no way on from here
+
+      // the loop's own UNTIL. done: exit to the word after it
+      //
+      case OP_JITUNTIL:
+         if ( i != n - 1 || d != 1 ) return false ;
+         e.aluImm(7, R(0), 1) ;
+         e.patch(e.jcc(CC_NE), start[0]) ;
+         {
+            JitExit x = { 1, 0 } ;
+            loop.m_exits.push_back(x) ;
+            e.leave(loop.m_exits.size() - 1) ;
+         }
+         continue ;
+
+      default:
+         return false ;
+      }
+
+      REACH(i, i + 1) ;
+   }
+
+#undef R
+#undef NEED
+#undef ROOM
+#undef SETVAR
+#undef VAR
+#undef OVERFLOW
+#undef REACH
+
+   for (size_t j = 0 ; j < jumps.size() ; j++) {
+      e.patch(jumps[j].first, start[jumps[j].second]) ;
+   }
+
+   // the other exits spill what they hold
+   //
+   for (size_t j = 0 ; j < exits.size() ; j++) {
+      const JitExit& x = loop.m_exits[exits[j].m_exit] ;
+
+      e.patch(exits[j].m_jump, e.pos()) ;
+      for (int c = 0 ; c < x.m_depth ; c++) {
+         e.store(RSI, (int) sizeof(cell_t) * c, cellReg[c]) ;
+      }
+      e.leave(exits[j].m_exit) ;
+   }
+
+   // into memory of its own, made executable once written
+   //
+   long page = sysconf(_SC_PAGESIZE) ;
+   size_t size = (e.pos() + page - 1) / page * page ;
+   void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) ;
+
+   if ( mem == MAP_FAILED ) return false ;
+   memcpy(mem, &e.m_code[0], e.pos()) ;
+   if ( mprotect(mem, size, PROT_READ | PROT_EXEC) != 0 ) {
+      munmap(mem, size) ;
+      return false ;
+   }
+
+   loop.m_mem = mem ;
+   loop.m_memSize = size ;
+   loop.m_native = (jit_fn) mem ;
+   return true ;
+}
+
+#else
+
+bool Sally::jitCompile(JitLoop& loop, const Instr *until) {
+   return false ;
+}
+
+#endif
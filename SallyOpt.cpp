@@ -0,0 +1,288 @@
+// File: SallyOpt.cpp
+//
+//
+// Optimizer passes for compiled Sally Forth code
+//
+// fold() evaluates arithmetic, comparisons and logic on
+// literals at compile time and removes IFTHEN branches whose
+// condition is a literal.
+//
+// optimize() is a peephole optimizer. Short sequences of
+// words that show up everywhere in Sally Forth programs are
+// fused into single superinstructions:
+//
+//    n +   n -              OP_ADDI n
+//    DUP *                  OP_SQUARE
+//    SWAP DROP              OP_NIP
+//    x @ n + x !            OP_VARADD x, n
+//    comparison IFTHEN      OP_IFLT ... OP_IFGT
+//
+
+#include <iostream>
+#include <vector>
+using namespace std ;
+
+#include "Sally.h"
+
+
+// Names of the fusions for the report, in Fusion order.
+//
+static const char *fusionNames[FUSE_COUNT] = {
+   "constants folded",
+   "constant IFTHEN",
+   "n + / n -",
+   "DUP *",
+   "SWAP DROP",
+   "x @ n + x !",
+   "comparison IFTHEN"
+} ;
+
+
+// True if op is a branch; its m_arg is an offset from
+// the branch itself.
+//
+bool isBranch(OpCode op) {
+   switch (op) {
+   case OP_IFTHEN: case OP_ELSE: case OP_UNTIL:
+   case OP_IFLT: case OP_IFLE: case OP_IFEQ:
+   case OP_IFNE: case OP_IFGE: case OP_IFGT:
+      return true ;
+   default:
+      return false ;
+   }
+}
+
+
+// Make the branch offsets in prog absolute and mark where
+// branches land.
+//
+static void absoluteBranches(vector<Instr>& prog, vector<char>& target) {
+   int n = prog.size() ;
+
+   target.assign(n + 1, 0) ;
+   for (int i = 0 ; i < n ; i++) {
+      if ( isBranch(prog[i].m_op) ) {
+         prog[i].m_arg += i ;
+         target[prog[i].m_arg] = 1 ;
+      }
+   }
+}
+
+
+// Make the absolute branch targets in out, which are
+// positions in the old code of n instructions, relative
+// again. from[k] is the position in the old code that out[k]
+// came from (-1 for none). A branch to a removed instruction
+// goes to the next one that was kept.
+//
+static void relativeBranches(vector<Instr>& out, const vector<int>& from, int n) {
+   vector<int> where(n + 1, -1) ;
+   int k ;
+
+   where[n] = out.size() ;
+   for (k = out.size() - 1 ; k >= 0 ; k--) {
+      if ( from[k] >= 0 ) where[from[k]] = k ;
+   }
+   for (k = n - 1 ; k >= 0 ; k--) {
+      if ( where[k] < 0 ) where[k] = where[k+1] ;
+   }
+
+   for (k = 0 ; k < (int) out.size() ; k++) {
+      if ( isBranch(out[k].m_op) ) {
+         out[k].m_arg = where[out[k].m_arg] - k ;
+      }
+   }
+}
+
+
+// Value of the binary word op applied to literals a and b,
+// done by cellOp() just as it would be at run time. Returns
+// false if it can not be done at compile time: not a binary
+// word, or one that would fail, which is left to fail when
+// it runs.
+//
+static bool foldBinary(OpCode op, cell_t a, cell_t b, cell_t& result) {
+   switch (op) {
+   case OP_PLUS:   return cellOp<OP_PLUS>(a, b, result) ;
+   case OP_MINUS:  return cellOp<OP_MINUS>(a, b, result) ;
+   case OP_TIMES:  return cellOp<OP_TIMES>(a, b, result) ;
+   case OP_DIVIDE: return cellOp<OP_DIVIDE>(a, b, result) ;
+   case OP_MOD:    return cellOp<OP_MOD>(a, b, result) ;
+   case OP_LT:     return cellOp<OP_LT>(a, b, result) ;
+   case OP_LE:     return cellOp<OP_LE>(a, b, result) ;
+   case OP_EQ:     return cellOp<OP_EQ>(a, b, result) ;
+   case OP_NE:     return cellOp<OP_NE>(a, b, result) ;
+   case OP_GE:     return cellOp<OP_GE>(a, b, result) ;
+   case OP_GT:     return cellOp<OP_GT>(a, b, result) ;
+   case OP_AND:    return cellOp<OP_AND>(a, b, result) ;
+   case OP_OR:     return cellOp<OP_OR>(a, b, result) ;
+   default:        return false ;
+   }
+}
+
+
+// Constant folding and dead branch removal.
+//
+// Works like optimize(): instructions are copied one at a
+// time and the tail of the copy is folded while possible, so
+// 1 1 + 2 == becomes 1 and then lets the IFTHEN after it be
+// removed. For a literal IFTHEN the branch that can not run
+// is marked dead and never copied; when the true branch runs
+// its ELSE and the false branch are dead.
+//
+void Sally::fold(vector<Instr>& prog) {
+   int n = prog.size() ;
+   vector<char> target ;             // a branch lands here
+   vector<char> dead(n, 0) ;         // never runs, not copied
+   vector<Instr> out ;
+   vector<int> from ;
+   int label = 0 ;                   // no folding with out[] before this
+   int i, j, k ;
+   cell_t r ;
+
+   absoluteBranches(prog, target) ;
+
+   for (i = 0 ; i < n ; i++) {
+
+      if ( target[i] ) {
+         label = out.size() ;
+      }
+      if ( dead[i] ) {
+         continue ;
+      }
+      out.push_back(prog[i]) ;
+      from.push_back(i) ;
+
+      while (1) {
+         k = out.size() - 1 ;
+         int avail = out.size() - label ;
+
+         // a folded IFTHEN can take out everything after label
+         if ( avail < 2 || out[k-1].m_op != OP_INT ) break ;
+         OpCode op = out[k].m_op ;
+         cell_t b = out[k-1].m_arg ;
+
+         if ( op == OP_NEG && cellOp<OP_MINUS>(0, b, r) ) {
+            out[k-1].m_arg = r ;
+
+         } else if ( op == OP_NOT ) {
+            out[k-1].m_arg = (b == 0) ;
+
+         } else if ( avail >= 3 && out[k-2].m_op == OP_INT
+                     && foldBinary(op, out[k-2].m_arg, b, r) ) {
+            out[k-2].m_arg = r ;
+            out.pop_back() ;
+            from.pop_back() ;
+
+         } else if ( op == OP_IFTHEN ) {
+            int t = out[k].m_arg ;      // past the ELSE, or the ENDIF
+
+            if ( b == 1 ) {
+               // drop the ELSE and the false branch. an ELSE
+               // that jumps to t does nothing either way.
+               if ( t - 1 > i && prog[t-1].m_op == OP_ELSE ) {
+                  for (j = t - 1 ; j < prog[t-1].m_arg ; j++) dead[j] = 1 ;
+               }
+            } else {
+               for (j = i + 1 ; j < t ; j++) dead[j] = 1 ;
+            }
+            out.pop_back() ;
+            from.pop_back() ;
+            fusions[FUSE_BRANCH]++ ;
+
+         } else {
+            break ;
+         }
+
+         if ( op != OP_IFTHEN ) fusions[FUSE_FOLD]++ ;
+         out.pop_back() ;
+         from.pop_back() ;
+      }
+   }
+
+   relativeBranches(out, from, n) ;
+   prog.swap(out) ;
+}
+
+
+// Run the peephole optimizer over prog, a compiled unit or the
+// body of a colon definition.
+//
+// Instructions are copied to a new vector one at a time and the
+// tail of the new vector is fused as long as one of the patterns
+// matches. Nothing is fused across a place where a branch lands.
+// Branch offsets are made absolute while this is going on, and
+// relative again at the end.
+//
+void Sally::optimize(vector<Instr>& prog) {
+   int n = prog.size() ;
+   vector<char> target ;             // a branch lands here
+   vector<Instr> out ;               // optimized code
+   vector<int> from ;                // where in prog each out[] came from
+   int label = 0 ;                   // no fusing with out[] before this
+   int i, k ;
+
+   absoluteBranches(prog, target) ;
+
+   for (i = 0 ; i < n ; i++) {
+      if ( target[i] ) {
+         label = out.size() ;
+      }
+      out.push_back(prog[i]) ;
+      from.push_back(i) ;
+
+      while (1) {
+         k = out.size() - 1 ;          // the instruction just added
+         OpCode op = out[k].m_op ;
+         int avail = out.size() - label ;
+
+         if ( avail < 2 ) break ;
+         Instr& prev = out[k-1] ;
+
+         if ( (op == OP_PLUS || op == OP_MINUS) && prev.m_op == OP_INT
+              && prev.m_arg != CELL_MIN ) {
+            prev = Instr(OP_ADDI, op == OP_PLUS ? prev.m_arg : -prev.m_arg, prev.m_line) ;
+            fusions[FUSE_ADDI]++ ;
+
+         } else if ( op == OP_TIMES && prev.m_op == OP_DUP ) {
+            prev = Instr(OP_SQUARE, 0, prev.m_line) ;
+            fusions[FUSE_SQUARE]++ ;
+
+         } else if ( op == OP_DROP && prev.m_op == OP_SWAP ) {
+            prev = Instr(OP_NIP, 0, prev.m_line) ;
+            fusions[FUSE_NIP]++ ;
+
+         } else if ( op == OP_VARSTORE && prev.m_op == OP_ADDI && avail >= 3
+                     && out[k-2].m_op == OP_VARAT
+                     && out[k-2].m_arg == out[k].m_arg ) {
+            out[k-2].m_op = OP_VARADD ;
+            prev = Instr(OP_DATA, prev.m_arg, prev.m_line) ;
+            from[k-1] = -1 ;
+            fusions[FUSE_VARADD]++ ;
+
+         } else if ( op == OP_IFTHEN && prev.m_op >= OP_LT && prev.m_op <= OP_GT ) {
+            prev = Instr( OpCode(OP_IFLT + (prev.m_op - OP_LT)), out[k].m_arg, prev.m_line ) ;
+            fusions[FUSE_IF]++ ;
+
+         } else {
+            break ;
+         }
+
+         out.pop_back() ;
+         from.pop_back() ;
+      }
+   }
+
+   relativeBranches(out, from, n) ;
+   prog.swap(out) ;
+}
+
+
+// Print how many times each fusion and fold was done.
+//
+void Sally::reportFusions(ostream& os) {
+   os << "Fusions:\n" ;
+   for (int f = 0 ; f < FUSE_COUNT ; f++) {
+      os << "   " << fusionNames[f] << ": " << fusions[f] << "\n" ;
+   }
+}
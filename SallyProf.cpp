@@ -0,0 +1,362 @@
+// File: SallyProf.cpp
+//
+//
+// Execution profile and trace of the Sally Forth interpreter
+//
+// With SallyOptions::m_profile on, execute() calls profile()
+// before every instruction. It counts the opcode, charges it
+// the time since the last one, follows calls into colon
+// definitions and counts reads and writes of variables.
+//
+// With SallyOptions::m_trace on, execute() records every
+// instruction in a TraceRing. The trace is printed when the
+// program dies of an error.
+//
+// DUMP prints what has been gathered so far along with the
+// stack and the variables; so does the interpreter when it
+// is done profiling.
+//
+
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <algorithm>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+using namespace std ;
+
+#include "Sally.h"
+
+
+// Names of the opcodes for the report, in OpCode order.
+// Fused instructions are named after what they replace.
+//
+static const char *opNames[OP_COUNT] = {
+   "nop", "end", "number", "string", "name",
+   "IFTHEN", "ELSE", "ENDIF", "DO", "UNTIL",
+   "DUMP",
+   "+", "-", "*", "/", "%", "NEG",
+   ".", "SP", "CR",
+   "DUP", "DROP", "SWAP", "ROT",
+   "SET", "@", "!",
+   "<", "<=", "==", "!=", ">=", ">",
+   "AND", "OR", "NOT",
+   "name @", "name !", "name SET",
+   ":", ";", "call", "return",
+   "n +", "DUP *", "SWAP DROP", "x @ n + x !", "data",
+   "< IFTHEN", "<= IFTHEN", "== IFTHEN",
+   "!= IFTHEN", ">= IFTHEN", "> IFTHEN",
+   "ARRAY", "AFILL", "ACOPY", "ALEN", "A@", "A!",
+   "A+", "A-", "A*",
+   "A<", "A<=", "A==", "A!=", "A>=", "A>",
+   "ASUM", "AMIN", "AMAX",
+   "AMARK", "ARELEASE",
+   "HERE", "ALLOT", ",", "CREATE", "RESET",
+   "UNTIL"
+} ;
+
+
+// Time stamp counter, or a nanosecond clock where
+// there isn't one.
+//
+static inline unsigned long long cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+   return __rdtsc() ;
+#else
+   struct timespec ts ;
+   clock_gettime(CLOCK_MONOTONIC, &ts) ;
+   return ts.tv_sec * 1000000000ULL + ts.tv_nsec ;
+#endif
+}
+
+
+// Empty profile.
+//
+Profile::Profile() {
+   for (int op = 0 ; op < OP_COUNT ; op++) {
+      m_count[op] = 0 ;
+      m_cycles[op] = 0 ;
+   }
+   m_last = OP_NOP ;
+   m_stamp = 0 ;
+}
+
+
+// Ring of at least size entries.
+//
+TraceRing::TraceRing(int size) {
+   int n = 1 ;
+
+   while ( n < size ) {
+      n *= 2 ;
+   }
+   m_ring.resize( size > 0 ? n : 0 ) ;
+   m_mask = n - 1 ;
+   m_next = 0 ;
+}
+
+
+// Count one more use of a variable slot.
+//
+static void countUse(vector<long long>& uses, int slot) {
+   if ( slot >= (int) uses.size() ) {
+      uses.resize(slot + 1, 0) ;
+   }
+   uses[slot]++ ;
+}
+
+
+// Called as execute() starts on a new unit. Time spent
+// compiling is not charged to anything, and calls left
+// open by an error are forgotten.
+//
+void Sally::profileStart() {
+   prof.m_frames.clear() ;
+   prof.m_last = OP_NOP ;
+   prof.m_stamp = cycles() ;
+}
+
+
+// Called before the instruction at in runs.
+//
+void Sally::profile(const Instr *in) {
+   unsigned long long now = cycles() ;
+
+   prof.m_cycles[prof.m_last] += now - prof.m_stamp ;
+   prof.m_stamp = now ;
+   prof.m_last = in->m_op ;
+   prof.m_count[in->m_op]++ ;
+
+   switch (in->m_op) {
+
+   case OP_CALL:
+      prof.m_frames.push_back( make_pair(in->m_arg, now) ) ;
+      break ;
+
+   case OP_EXIT:
+      if ( !prof.m_frames.empty() ) {
+         int body = prof.m_frames.back().first ;
+
+         if ( body >= (int) prof.m_calls.size() ) {
+            prof.m_calls.resize(body + 1, 0) ;
+            prof.m_callCycles.resize(body + 1, 0) ;
+         }
+         prof.m_calls[body]++ ;
+         prof.m_callCycles[body] += now - prof.m_frames.back().second ;
+         prof.m_frames.pop_back() ;
+      }
+      break ;
+
+   // the variable of @ ! and SET is on top of the stack
+   //
+   case OP_AT:
+   case OP_STORE:
+   case OP_SET:
+      if ( params.size() > 0 && params.top().m_kind == VARIABLE ) {
+         countUse(in->m_op == OP_AT ? prof.m_reads : prof.m_writes,
+                  params.top().m_value) ;
+      }
+      break ;
+
+   case OP_VARAT:
+      countUse(prof.m_reads, in->m_arg) ;
+      break ;
+
+   case OP_VARSTORE:
+   case OP_VARSET:
+      countUse(prof.m_writes, in->m_arg) ;
+      break ;
+
+   case OP_VARADD:
+      countUse(prof.m_reads, in->m_arg) ;
+      countUse(prof.m_writes, in->m_arg) ;
+      break ;
+
+   default:
+      break ;
+   }
+}
+
+
+// for sorting the report, most time first
+//
+struct ProfileLine {
+   string m_name ;
+   long long m_count ;
+   unsigned long long m_cycles ;
+
+   bool operator<(const ProfileLine& other) const {
+      return m_cycles > other.m_cycles ;
+   }
+} ;
+
+
+static void printLines(ostream& os, vector<ProfileLine>& lines) {
+   sort(lines.begin(), lines.end()) ;
+
+   os << "          count           cycles  cycles/count  word\n" ;
+   for (size_t i = 0 ; i < lines.size() ; i++) {
+      os << setw(15) << lines[i].m_count
+         << setw(17) << lines[i].m_cycles
+         << setw(14) << lines[i].m_cycles / lines[i].m_count
+         << "  " << lines[i].m_name << "\n" ;
+   }
+}
+
+
+// Print the words and definitions run so far, most
+// time first.
+//
+void Sally::reportProfile(ostream& os) {
+   vector<ProfileLine> lines ;
+   ProfileLine line ;
+
+   for (int op = 0 ; op < OP_COUNT ; op++) {
+      if ( prof.m_count[op] > 0 ) {
+         line.m_name = opNames[op] ;
+         line.m_count = prof.m_count[op] ;
+         line.m_cycles = prof.m_cycles[op] ;
+         lines.push_back(line) ;
+      }
+   }
+   os << "Words:\n" ;
+   printLines(os, lines) ;
+
+   lines.clear() ;
+   for (size_t body = 0 ; body < prof.m_calls.size() ; body++) {
+      if ( prof.m_calls[body] > 0 ) {
+         line.m_name = definitionName(body) ;
+         line.m_count = prof.m_calls[body] ;
+         line.m_cycles = prof.m_callCycles[body] ;
+         lines.push_back(line) ;
+      }
+   }
+   if ( !lines.empty() ) {
+      os << "Definitions (not inlined):\n" ;
+      printLines(os, lines) ;
+   }
+}
+
+
+// Name of the colon definition whose body starts at
+// dict[body]. Bodies replaced by a new definition have no
+// name any more.
+//
+string Sally::definitionName(int body) {
+   map<string,SymTabEntry>::iterator it ;
+
+   for (it = symtab.begin() ; it != symtab.end() ; it++) {
+      if ( it->second.m_opcode == OP_CALL && it->second.m_value == body ) {
+         return it->first ;
+      }
+   }
+   return "(redefined)" ;
+}
+
+
+// What adding n looks like in the source: n +, or m - for
+// a negative n = -m, which is what m - is compiled to.
+//
+static string addText(cell_t n) {
+   ostringstream os ;
+
+   if ( n < 0 && n != CELL_MIN ) {
+      os << -n << " -" ;
+   } else {
+      os << n << " +" ;
+   }
+   return os.str() ;
+}
+
+
+// The source of the word an instruction was compiled
+// from, as well as it can be told. data is the m_arg of
+// the OP_DATA after an OP_VARADD, its amount.
+// Superinstructions come out as the words they were fused
+// from, so messages about them name what was written.
+//
+string Sally::wordText(int op, cell_t arg, cell_t data) {
+   ostringstream word ;
+
+   switch (op) {
+   case OP_INT:      word << arg ; break ;
+   case OP_STR:      word << ".\"" << pool[arg] << "\"" ; break ;
+   case OP_NAME:     word << pool[varNames[arg]] ; break ;
+   case OP_VARAT:    word << pool[varNames[arg]] << " @" ; break ;
+   case OP_VARSTORE: word << pool[varNames[arg]] << " !" ; break ;
+   case OP_VARSET:   word << pool[varNames[arg]] << " SET" ; break ;
+   case OP_VARADD:   word << pool[varNames[arg]] << " @ " << addText(data) << " "
+                          << pool[varNames[arg]] << " !" ; break ;
+   case OP_ADDI:     word << addText(arg) ; break ;
+   case OP_CALL:     word << definitionName(arg) ; break ;
+   default:          word << opNames[op] ; break ;
+   }
+   return word.str() ;
+}
+
+
+// Print the words in the trace, oldest first, with the
+// source line each came from and the stack depth before it
+// ran. The last one is the word that failed, if one did.
+//
+void Sally::reportTrace(ostream& os) {
+   os << "Last " << trace.size() << " words run:\n" ;
+
+   for (int i = 0 ; i < trace.size() ; i++) {
+      const TraceEntry& e = trace[i] ;
+
+      os << "   line " << setw(5) << left << e.m_line << right
+         << " depth " << setw(5) << left << e.m_depth << right
+         << " " << wordText(e.m_op, e.m_arg, e.m_data) << "\n" ;
+   }
+}
+
+
+// Print the profile and trace if there are any, then the
+// stack from the bottom up and the variables with their
+// values.
+//
+void Sally::dump(ostream& os) {
+
+   if ( profileOn ) {
+      reportProfile(os) ;
+   }
+   if ( traceOn ) {
+      reportTrace(os) ;
+   }
+
+   os << "Stack (" << params.size() << "):" ;
+   for (int i = params.size() - 1 ; i >= 0 ; i--) {
+      Cell& c = params.peek(i) ;
+
+      if ( c.m_kind == INTEGER ) {
+         os << " " << c.m_value ;
+      } else if ( c.m_kind == STRING ) {
+         os << " \"" << pool[c.m_value] << "\"" ;
+      } else if ( c.m_kind == ARRAY ) {
+         os << " " << cellText(c) ;
+      } else {
+         os << " " << pool[varNames[c.m_value]] ;
+      }
+   }
+   os << "\n" ;
+
+   if ( !dataSpace.empty() ) {
+      os << "Data space: " << dataSpace.size() << " cells\n" ;
+   }
+
+   os << "Variables:\n" ;
+   for (size_t slot = 0 ; slot < vars.size() ; slot++) {
+      if ( !varIsSet[slot] ) continue ;
+
+      os << "   " << pool[varNames[slot]] << " = " << vars[slot] ;
+      if ( profileOn ) {
+         os << "   reads " << (slot < prof.m_reads.size() ? prof.m_reads[slot] : 0)
+            << ", writes " << (slot < prof.m_writes.size() ? prof.m_writes[slot] : 0) ;
+      }
+      os << "\n" ;
+   }
+}
@@ -0,0 +1,300 @@
+// File: SallyVerify.cpp
+//
+//
+// Stack effect checks of the Sally Forth interpreter
+//
+// Before a unit runs, verify() works out how deep the stack
+// can be before each of its words, relative to where it
+// starts: an interval, taken over every way of getting to
+// the word. Branches that join take in both intervals. A
+// loop that makes the stack deeper or shallower each time
+// round has it go without limit. Colon definitions are
+// worked out the same way once, and a call does what its
+// definition does.
+//
+// With the stack as deep as it is when the unit starts:
+//
+//   - if a word the unit always gets to (one not inside an
+//     IFTHEN or ELSE) is sure to find too few cells, the
+//     unit is not run; it is a compile error, naming the
+//     line and the word
+//
+//   - if no word can find too few, the unit runs in
+//     run<HOOK_UNCHECKED>, which doesn't look for underflow
+//
+//   - anything else runs with the checks, as before
+//
+
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <algorithm>
+using namespace std ;
+
+#include "Sally.h"
+
+
+StackEffect::StackEffect(int need, int sure, int lo, int hi) {
+   m_need = need ;
+   m_sure = sure ;
+   m_lo = lo ;
+   m_hi = hi ;
+}
+
+
+// a + b, where either may be unbounded
+//
+static int add(int a, int b) {
+   if ( a <= -SALLY_UNBOUNDED || b <= -SALLY_UNBOUNDED ) return -SALLY_UNBOUNDED ;
+   if ( a >= SALLY_UNBOUNDED || b >= SALLY_UNBOUNDED ) return SALLY_UNBOUNDED ;
+   return a + b ;
+}
+
+
+// a word that takes n cells and leaves the stack change
+// cells deeper
+//
+static StackEffect takes(int n, int change) {
+   return StackEffect(n, n, change, change) ;
+}
+
+
+// What the word at in does to the stack. Its branches are
+// none of this; see depths().
+//
+StackEffect Sally::wordEffect(const Instr *in) {
+
+   switch (in->m_op) {
+
+   case OP_INT: case OP_STR: case OP_NAME: case OP_VARAT:
+   case OP_HERE: case OP_AMARK:
+      return takes(0, 1) ;
+
+   case OP_IFTHEN: case OP_UNTIL: case OP_JITUNTIL:
+   case OP_DOT: case OP_DROP: case OP_VARSTORE: case OP_VARSET:
+   case OP_ALLOT: case OP_COMMA: case OP_CREATE: case OP_RESET:
+   case OP_ARELEASE:
+      return takes(1, -1) ;
+
+   case OP_NEG: case OP_NOT: case OP_AT:
+   case OP_ADDI: case OP_SQUARE:
+   case OP_ACOPY: case OP_ALEN:
+   case OP_ASUM: case OP_AMIN: case OP_AMAX:
+      return takes(1, 0) ;
+
+   case OP_DUP:
+      return takes(1, 1) ;
+
+   case OP_PLUS: case OP_MINUS: case OP_TIMES: case OP_DIVIDE: case OP_MOD:
+   case OP_LT: case OP_LE: case OP_EQ: case OP_NE: case OP_GE: case OP_GT:
+   case OP_AND: case OP_OR: case OP_NIP:
+   case OP_ARRAY: case OP_AFILL: case OP_AAT:
+   case OP_APLUS: case OP_AMINUS: case OP_ATIMES:
+   case OP_ALT: case OP_ALE: case OP_AEQ:
+   case OP_ANE: case OP_AGE: case OP_AGT:
+      return takes(2, -1) ;
+
+   case OP_SWAP:
+      return takes(2, 0) ;
+
+   case OP_ROT:
+      return takes(3, 0) ;
+
+   case OP_ASTORE:
+      return takes(3, -3) ;
+
+   case OP_SET: case OP_STORE:
+   case OP_IFLT: case OP_IFLE: case OP_IFEQ:
+   case OP_IFNE: case OP_IFGE: case OP_IFGT:
+      return takes(2, -2) ;
+
+   case OP_CALL:
+      return definitionEffect(in->m_arg) ;
+
+   default:
+      return takes(0, 0) ;
+   }
+}
+
+
+// Work out the depth of the stack before each of the n
+// words of prog, relative to the first, into lo and hi.
+// Words never got to have lo > hi. always says whether a
+// word is got to every time prog runs.
+//
+// Words are gone through in order, going back to the start
+// of a loop when its UNTIL takes the loop somewhere new.
+// Since that widens the loop's interval to no limit at once,
+// each loop is gone back to at most twice.
+//
+void Sally::depths(const Instr *prog, int n, vector<int>& lo,
+                   vector<int>& hi, vector<char>& always) {
+   vector<int> inside(n + 1, 0) ;      // IFTHENs and ELSEs a word is in
+   int i, to, l, h ;
+
+   for (i = 0 ; i < n ; i++) {
+      switch (prog[i].m_op) {
+      case OP_IFTHEN: case OP_ELSE:
+      case OP_IFLT: case OP_IFLE: case OP_IFEQ:
+      case OP_IFNE: case OP_IFGE: case OP_IFGT:
+         inside[i + 1]++ ;
+         inside[i + prog[i].m_arg]-- ;
+         break ;
+      default:
+         break ;
+      }
+   }
+   always.assign(n, 0) ;
+   for (i = 0, l = 0 ; i < n ; i++) {
+      l += inside[i] ;
+      always[i] = (l == 0) ;
+   }
+
+   lo.assign(n, SALLY_UNBOUNDED) ;
+   hi.assign(n, -SALLY_UNBOUNDED) ;
+   lo[0] = hi[0] = 0 ;
+
+   // take in [l, h] at word to; true if it got back to
+   // a word already gone through with something new
+   //
+   auto reach = [&](int to) -> bool {
+      bool seen = (lo[to] <= hi[to]) ;
+      bool grew = false ;
+
+      if ( l < lo[to] ) {
+         lo[to] = (seen && to <= i) ? -SALLY_UNBOUNDED : l ;
+         grew = true ;
+      }
+      if ( h > hi[to] ) {
+         hi[to] = (seen && to <= i) ? SALLY_UNBOUNDED : h ;
+         grew = true ;
+      }
+      return grew && to <= i ;
+   } ;
+
+   for (i = 0 ; i < n ; i++) {
+      const Instr *in = prog + i ;
+
+      if ( lo[i] > hi[i] ) continue ;
+
+      StackEffect e = wordEffect(in) ;
+      l = add(lo[i], e.m_lo) ;
+      h = add(hi[i], e.m_hi) ;
+
+      switch (in->m_op) {
+
+      case OP_HALT:
+      case OP_EXIT:
+         break ;
+
+      case OP_ELSE:
+         reach(i + in->m_arg) ;
+         break ;
+
+      case OP_IFTHEN:
+      case OP_IFLT: case OP_IFLE: case OP_IFEQ:
+      case OP_IFNE: case OP_IFGE: case OP_IFGT:
+         reach(i + in->m_arg) ;
+         reach(i + 1) ;
+         break ;
+
+      case OP_UNTIL:
+      case OP_JITUNTIL:
+         to = i + (in->m_op == OP_UNTIL ? in->m_arg : jitLoops[in->m_arg].m_offset) ;
+         reach(i + 1) ;
+         if ( reach(to) ) {
+            i = to - 1 ;          // round the loop again
+         }
+         break ;
+
+      case OP_VARADD:
+         reach(i + 2) ;           // past its OP_DATA
+         break ;
+
+      default:
+         reach(i + 1) ;
+         break ;
+      }
+   }
+}
+
+
+// What the colon definition whose body starts at dict[body]
+// does to the stack. Worked out the first time it is asked
+// for; definitions don't change, and can only call ones
+// made before them.
+//
+StackEffect Sally::definitionEffect(int body) {
+   map<int,StackEffect>::iterator it = dictEffects.find(body) ;
+
+   if ( it != dictEffects.end() ) {
+      return it->second ;
+   }
+
+   vector<int> lo, hi ;
+   vector<char> always ;
+   int n = dictLength(body) + 1 ;            // with its OP_EXIT
+   StackEffect effect ;
+
+   depths(&dict[body], n, lo, hi, always) ;
+
+   effect.m_sure = -SALLY_UNBOUNDED ;
+   for (int i = 0 ; i < n ; i++) {
+      if ( lo[i] > hi[i] ) continue ;
+
+      StackEffect e = wordEffect(&dict[body + i]) ;
+      effect.m_need = max(effect.m_need, add(e.m_need, -lo[i])) ;
+      if ( always[i] ) {
+         effect.m_sure = max(effect.m_sure, add(e.m_sure, -hi[i])) ;
+      }
+   }
+
+   // a definition that never returns changes nothing after it
+   //
+   if ( lo[n - 1] <= hi[n - 1] ) {
+      effect.m_lo = lo[n - 1] ;
+      effect.m_hi = hi[n - 1] ;
+   }
+
+   dictEffects[body] = effect ;
+   return effect ;
+}
+
+
+// Check the code of the unit against the stack it will
+// start with. Throws CompileError, naming the first word
+// that is sure to underflow, if there is one. True if no
+// word can underflow.
+//
+bool Sally::verify() {
+   vector<int> lo, hi ;
+   vector<char> always ;
+   int n = code.size() ;
+   int depth = params.size() ;
+   int need = 0 ;
+
+   depths(&code[0], n, lo, hi, always) ;
+
+   for (int i = 0 ; i < n ; i++) {
+      if ( lo[i] > hi[i] ) continue ;
+
+      StackEffect e = wordEffect(&code[i]) ;
+
+      if ( always[i] && add(depth, hi[i]) < e.m_sure ) {
+         ostringstream msg ;
+
+         msg << "stack underflow at line " << code[i].m_line << ": "
+             << wordText(code[i].m_op, code[i].m_arg,
+                         code[i].m_op == OP_VARADD ? code[i + 1].m_arg : 0)
+             << " needs " << e.m_sure
+             << (e.m_sure == 1 ? " parameter" : " parameters")
+             << ", the stack has at most "
+             << max(0, depth + hi[i]) ;
+         throw CompileError( msg.str() ) ;
+      }
+      need = max(need, add(e.m_need, -lo[i])) ;
+   }
+
+   return depth >= need ;
+}
@@ -0,0 +1,351 @@
+// File: bench/bench.cpp
+//
+//
+// Benchmarks for the Sally Forth interpreter
+//
+// Micro benchmarks time one builtin word at a time inside a
+// DO ... UNTIL loop, with the optimizer off so that the word
+// really runs. The time of the same loop with an empty body
+// is subtracted.
+//
+// Macro benchmarks run whole programs: the example*.sally
+// files and some made up ones (long loops, deep nesting,
+// lots of printing, colon definitions).
+//
+// Every benchmark, each example and each made up program
+// too, runs in its own child process so that its peak RSS
+// can be reported. Results are printed one JSON object per
+// line:
+//
+//   {"kind":"micro","name":"+","words":...,"seconds":...,
+//    "ns_per_word":...,"words_per_sec":...,"peak_rss_kb":...}
+//
+// Usage: bench [-micro] [-macro] [-quick] [dir-with-examples]
+//
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <glob.h>
+#include <time.h>
+#include "Sally.h"
+using namespace std ;
+
+
+// Throws away everything written to it.
+//
+class NullBuf : public streambuf {
+protected:
+   int overflow(int c) { return c ; }
+   streamsize xsputn(const char *, streamsize n) { return n ; }
+} ;
+
+static NullBuf nullbuf ;
+static ostream nullout(&nullbuf) ;
+
+
+// Scale for loop counts; -quick divides by 10.
+//
+static long scale = 1 ;
+
+
+static double now() {
+   struct timespec ts ;
+   clock_gettime(CLOCK_MONOTONIC, &ts) ;
+   return ts.tv_sec + ts.tv_nsec * 1e-9 ;
+}
+
+
+// Run program src once, output thrown away. Returns seconds.
+//
+static double runProgram(const string& src, const SallyOptions& opts) {
+   istringstream in(src) ;
+   double start = now() ;
+   Sally S(in, nullout, opts) ;
+   S.mainLoop() ;
+   return now() - start ;
+}
+
+
+// Count the words of a Sally Forth program the way the lexer
+// sees them: string literals are one word, comments none.
+//
+static long countWords(const string& src) {
+   istringstream in(src) ;
+   string line ;
+   long words = 0 ;
+
+   while ( getline(in, line) ) {
+      size_t pos = 0 ;
+      while (pos < line.size()) {
+         if (line[pos] == ' ' || line[pos] == '\t' || line[pos] == '\r') {
+            pos++ ;
+         } else if (line.compare(pos, 2, "//") == 0) {
+            break ;
+         } else if (line.compare(pos, 2, ".\"") == 0) {
+            size_t end = line.find('"', pos + 2) ;
+            pos = (end == string::npos) ? line.size() : end + 1 ;
+            words++ ;
+         } else {
+            while (pos < line.size() && line[pos] != ' ' && line[pos] != '\t') pos++ ;
+            words++ ;
+         }
+      }
+   }
+   return words ;
+}
+
+
+// Print one result line.
+//
+static void report(const char *kind, const string& name, long words, double secs) {
+   struct rusage ru ;
+   getrusage(RUSAGE_SELF, &ru) ;
+
+   double ns = (words > 0) ? secs * 1e9 / words : 0 ;
+   printf("{\"kind\":\"%s\",\"name\":\"", kind) ;
+   for (size_t i = 0 ; i < name.size() ; i++) {
+      if (name[i] == '"' || name[i] == '\\') putchar('\\') ;
+      putchar(name[i]) ;
+   }
+   printf("\",\"words\":%ld,\"seconds\":%.6f,\"ns_per_word\":%.3f,"
+          "\"words_per_sec\":%.0f,\"peak_rss_kb\":%ld}\n",
+          words, secs, ns, (ns > 0) ? 1e9 / ns : 0, ru.ru_maxrss) ;
+   fflush(stdout) ;
+}
+
+
+// A loop that runs body n times.
+//
+static string loop(const string& body, long n) {
+   ostringstream os ;
+   os << "0 i SET\n"
+      << "DO\n"
+      << body << "\n"
+      << "i @ 1 + i ! i @ " << n << " >=\n"
+      << "UNTIL\n" ;
+   return os.str() ;
+}
+
+
+// One micro benchmark: the word, and a snippet that uses it
+// and leaves the stack as it found it.
+//
+struct Micro {
+   const char *word ;
+   const char *snippet ;
+} ;
+
+static const Micro micros[] = {
+   { "+",      "1 2 + DROP" },
+   { "-",      "1 2 - DROP" },
+   { "*",      "3 2 * DROP" },
+   { "/",      "7 2 / DROP" },
+   { "%",      "7 2 % DROP" },
+   { "NEG",    "1 NEG DROP" },
+   { ".",      "1 ." },
+   { "SP",     "SP" },
+   { "CR",     "CR" },
+   { "DUP",    "1 DUP DROP DROP" },
+   { "DROP",   "1 DROP" },
+   { "SWAP",   "1 2 SWAP DROP DROP" },
+   { "ROT",    "1 2 3 ROT DROP DROP DROP" },
+   { "@",      "v @ DROP" },
+   { "!",      "1 v !" },
+   { "<",      "1 2 < DROP" },
+   { "<=",     "1 2 <= DROP" },
+   { "==",     "1 2 == DROP" },
+   { "!=",     "1 2 != DROP" },
+   { ">=",     "1 2 >= DROP" },
+   { ">",      "1 2 > DROP" },
+   { "AND",    "1 1 AND DROP" },
+   { "OR",     "1 0 OR DROP" },
+   { "NOT",    "1 NOT DROP" },
+   { "IFTHEN", "1 IFTHEN 2 ELSE 3 ENDIF DROP" },
+   { "DO",     "DO 1 UNTIL" },
+   { "DUMP",   "DUMP" },
+   { "call",   "ONE DROP" },
+} ;
+
+static const int unroll = 8 ;     // snippets per loop pass
+
+
+static void microBench(const Micro& m) {
+   SallyOptions opts ;
+   opts.m_optimize = false ;
+   opts.m_inlineLimit = 0 ;
+
+   long n = 1000000 / scale ;
+   string prelude = "0 v SET\n: ONE 1 ;\n" ;
+   string body ;
+   for (int i = 0 ; i < unroll ; i++) {
+      body += m.snippet ;
+      body += " " ;
+   }
+
+   double empty = runProgram(prelude + loop("", n), opts) ;
+   double full = runProgram(prelude + loop(body, n), opts) ;
+
+   report("micro", m.word, n * unroll * countWords(m.snippet), full - empty) ;
+}
+
+
+// SET can only be done once per variable, so it is timed
+// on a straight line of distinct variables instead.
+//
+static void microSET() {
+   SallyOptions opts ;
+   opts.m_optimize = false ;
+
+   long n = 200000 / scale ;
+   ostringstream os ;
+   for (long i = 0 ; i < n ; i++) {
+      os << i << " v" << i << " SET\n" ;
+   }
+   report("micro", "SET", 3 * n, runProgram(os.str(), opts)) ;
+}
+
+
+// Run fn in a child process, so every benchmark starts
+// with a fresh heap and reports its own peak RSS.
+//
+template <class F>
+static void isolated(F fn) {
+   pid_t pid = fork() ;
+
+   if (pid == 0) {
+      cerr.rdbuf(&nullbuf) ;      // end of program messages
+      fn() ;
+      exit(0) ;         // not _exit: profiling builds write
+                        // their counts at exit
+   }
+   int status ;
+   waitpid(pid, &status, 0) ;
+}
+
+
+// Made up programs: a name, the source, and how many words
+// it runs. Each runs in a child of its own.
+//
+static void syntheticBench(const string& name, const string& src, long words,
+                           const SallyOptions& opts = SallyOptions()) {
+   isolated( [&]() { report("macro", name, words, runProgram(src, opts)) ; } ) ;
+}
+
+
+static void macroSynthetic() {
+   long n = 2000000 / scale ;
+
+   // arithmetic in a long loop: 10 words per pass plus
+   // the 10 of the loop itself
+   //
+   syntheticBench("loop-arith",
+      "0 s SET\n" + loop("s @ i @ + 3 * 7 % s !", n), n * (10 + 10)) ;
+
+   // loops nested 6 deep around a conditional; only the
+   // innermost loop is counted: 9 words for the IFTHEN
+   // and 10 for the loop
+   //
+   const int depth = 6 ;
+   long m = (scale > 1) ? 6 : 10, inner = 1 ;
+   ostringstream os ;
+   os << "0 s SET\n" ;
+   for (int d = 0 ; d < depth ; d++) {
+      os << "0 d" << d << " SET\n" ;
+   }
+   for (int d = 0 ; d < depth ; d++) {
+      os << "0 d" << d << " !\nDO\n" ;
+      inner *= m ;
+   }
+   os << "d" << depth - 1 << " @ 2 % IFTHEN s @ 1 + s ! ELSE s @ 1 - s ! ENDIF\n" ;
+   for (int d = depth - 1 ; d >= 0 ; d--) {
+      os << "d" << d << " @ 1 + d" << d << " ! d" << d << " @ " << m << " >=\nUNTIL\n" ;
+   }
+   syntheticBench("nested", os.str(), inner * (9 + 10)) ;
+
+   // printing: 7 words per line
+   //
+   long p = 1000000 / scale ;
+   syntheticBench("print", loop(".\"line\" . SP i @ . CR", p), p * (7 + 10)) ;
+
+   // colon definitions, called and not inlined: STEP, its
+   // 9 words and the 2 of SQ
+   //
+   SallyOptions opts ;
+   opts.m_inlineLimit = 0 ;
+   string defs = ": SQ DUP * ;\n: STEP i @ SQ 1000 % s @ + s ! ;\n0 s SET\n" ;
+   syntheticBench("calls", defs + loop("STEP", n), n * (12 + 10), opts) ;
+}
+
+
+// Every example*.sally in dir, each in a child of its own.
+//
+static void macroExamples(const string& dir) {
+   int reps = 2000 / scale ;
+   string pattern = dir + "/example*.sally" ;
+   glob_t g ;
+
+   if ( glob(pattern.c_str(), 0, NULL, &g) != 0 ) {
+      cerr << "bench: no examples in " << dir << "\n" ;
+      return ;
+   }
+   for (size_t e = 0 ; e < g.gl_pathc ; e++) {
+      string path = g.gl_pathv[e] ;
+
+      ifstream f(path.c_str()) ;
+      if ( !f ) {
+         cerr << "bench: can't read " << path << "\n" ;
+         continue ;
+      }
+      stringstream src ;
+      src << f.rdbuf() ;
+
+      isolated( [&]() {
+         double secs = 0 ;
+         for (int r = 0 ; r < reps ; r++) {
+            secs += runProgram(src.str(), SallyOptions()) ;
+         }
+         report("macro", path, reps * countWords(src.str()), secs) ;
+      } ) ;
+   }
+   globfree(&g) ;
+}
+
+
+int main(int argc, char *argv[]) {
+   bool micro = false, macro = false ;
+   string dir = "." ;
+
+   for (int i = 1 ; i < argc ; i++) {
+      string arg = argv[i] ;
+      if (arg == "-micro") micro = true ;
+      else if (arg == "-macro") macro = true ;
+      else if (arg == "-quick") scale = 10 ;
+      else if (arg[0] != '-') dir = arg ;
+      else {
+         cerr << "usage: " << argv[0] << " [-micro] [-macro] [-quick] [dir]\n" ;
+         return 1 ;
+      }
+   }
+   if ( !micro && !macro ) micro = macro = true ;
+
+   if (micro) {
+      for (size_t m = 0 ; m < sizeof(micros) / sizeof(micros[0]) ; m++) {
+         isolated( [&]() { microBench(micros[m]) ; } ) ;
+      }
+      isolated( [&]() { microSET() ; } ) ;
+   }
+   if (macro) {
+      macroExamples(dir) ;
+      macroSynthetic() ;
+   }
+   return 0 ;
+}
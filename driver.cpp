@@ -3,13 +3,260 @@
 //
 // Simple driver program to call the Sally Forth interpreter
 //
+// With -batch every file given is run in an interpreter of its
+// own, several at a time on a pool of threads. Their output
+// comes out in the order the files were given.
+//
 
 
 #include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <unistd.h>
 #include "Sally.h"
 
-int main() {
-   Sally S ;
+
+// one program of a batch and what came of it
+//
+struct Job {
+   const char *m_path ;
+   string m_out ;        // its output
+   string m_err ;        // and its messages
+   bool m_readable ;
+   bool m_done ;
+} ;
+
+
+// Run each file in its own interpreter on nthreads threads.
+// A job's output goes to cout as soon as it and all the jobs
+// before it are done, under a header naming the file; its
+// messages go to cerr, each line starting with the file name.
+//
+static int runBatch(const vector<const char *>& files, SallyOptions opts,
+                    int nthreads) {
+   vector<Job> jobs( files.size() ) ;
+   atomic<size_t> next(0) ;
+   mutex lock ;
+   condition_variable finished ;
+   int status = 0 ;
+
+   // output goes into a string; no use flushing it by line
+   //
+   opts.m_flushPolicy = OutputSink::FLUSH_WHEN_FULL ;
+
+   for (size_t i = 0 ; i < jobs.size() ; i++) {
+      jobs[i].m_path = files[i] ;
+      jobs[i].m_readable = false ;
+      jobs[i].m_done = false ;
+   }
+
+   auto work = [&]() {
+      size_t i ;
+
+      while ( (i = next++) < jobs.size() ) {
+         istringstream in ;           // programs come from their files
+         ostringstream out, err ;
+         bool readable ;
+
+         {
+            Sally S(in, out, opts, err) ;
+
+            readable = S.loadFile(jobs[i].m_path) ;
+            if ( readable ) {
+               S.mainLoop() ;
+            }
+         }
+
+         lock_guard<mutex> guard(lock) ;
+         jobs[i].m_out = out.str() ;
+         jobs[i].m_err = err.str() ;
+         jobs[i].m_readable = readable ;
+         jobs[i].m_done = true ;
+         finished.notify_all() ;
+      }
+   } ;
+
+   if ( nthreads > (int) jobs.size() ) nthreads = jobs.size() ;
+   vector<thread> pool ;
+   for (int t = 0 ; t < nthreads ; t++) {
+      pool.push_back( thread(work) ) ;
+   }
+
+   for (size_t i = 0 ; i < jobs.size() ; i++) {
+      Job job ;
+      {
+         unique_lock<mutex> guard(lock) ;
+         finished.wait(guard, [&]() { return jobs[i].m_done ; }) ;
+         job.m_out.swap(jobs[i].m_out) ;
+         job.m_err.swap(jobs[i].m_err) ;
+         job.m_readable = jobs[i].m_readable ;
+      }
+
+      cout << "==> " << files[i] << " <==\n" << job.m_out << flush ;
+
+      if ( !job.m_readable ) {
+         cerr << files[i] << ": can't read\n" ;
+         status = 1 ;
+      }
+      istringstream msgs(job.m_err) ;
+      string line ;
+      while ( getline(msgs, line) ) {
+         cerr << files[i] << ": " << line << "\n" ;
+      }
+   }
+
+   for (size_t t = 0 ; t < pool.size() ; t++) {
+      pool[t].join() ;
+   }
+   return status ;
+}
+
+
+// Run each file with the JIT and without, and say whether
+// both printed the same output and messages and left the
+// same stack. The JIT compiles loops the first time round,
+// so as much of each program as it can take runs native.
+//
+static int jitCheck(const vector<const char *>& files, SallyOptions opts) {
+   int status = 0 ;
+
+   opts.m_flushPolicy = OutputSink::FLUSH_WHEN_FULL ;
+   opts.m_profile = false ;
+   opts.m_trace = 0 ;
+   opts.m_jitThreshold = 1 ;
+
+   for (size_t i = 0 ; i < files.size() ; i++) {
+      string result[2] ;
+      int loops = 0 ;
+      bool readable = true ;
+
+      for (int jit = 0 ; jit < 2 && readable ; jit++) {
+         istringstream in ;
+         ostringstream out, err ;
+
+         opts.m_jit = (jit == 1) ;
+         Sally S(in, out, opts, err) ;
+
+         readable = S.loadFile(files[i]) ;
+         if ( readable ) {
+            S.mainLoop() ;
+         }
+         err << "Stack:" ;
+         for (int c = S.stackDepth() - 1 ; c >= 0 ; c--) {
+            err << " " << S.cellText( S.stackCell(c) ) ;
+         }
+         result[jit] = out.str() + "--\n" + err.str() + "\n" ;
+         loops = S.nativeLoops() ;
+      }
+
+      if ( !readable ) {
+         cerr << files[i] << ": can't read\n" ;
+         status = 1 ;
+      } else if ( result[0] == result[1] ) {
+         cout << files[i] << ": same, " << loops << " loops compiled\n" ;
+      } else {
+         cout << files[i] << ": JIT differs\n"
+              << "==> interpreter <==\n" << result[0]
+              << "==> JIT <==\n" << result[1] ;
+         status = 1 ;
+      }
+   }
+   return status ;
+}
+
+
+static int usage(const char *prog) {
+   cerr << "usage: " << prog << " [-noopt] [-noverify] [-fusions] [-profile] [-trace[=N]] [-cache]"
+        << " [-jit[=N]] [-flush=line|full|exit] [-buffer=N] [file]\n"
+        << "       " << prog << " -batch [-jobs=N] [options] file...\n"
+        << "       " << prog << " -jitcheck [options] file...\n"
+        << "Options and files may come in any order.\n" ;
+   return 1 ;
+}
+
+
+int main(int argc, char *argv[]) {
+   SallyOptions opts ;
+   vector<const char *> files ;  // read cin if no file given
+   bool batch = false ;
+   bool jitcheck = false ;
+   int nthreads = thread::hardware_concurrency() ;
+
+   // line at a time when someone is watching
+   //
+   if ( isatty(1) ) {
+      opts.m_flushPolicy = OutputSink::FLUSH_EACH_LINE ;
+   }
+
+   for (int i = 1 ; i < argc ; i++) {
+      string arg = argv[i] ;
+
+      if (arg == "-noopt") {
+         opts.m_optimize = false ;        // no peephole optimizer
+      } else if (arg == "-noverify") {
+         opts.m_verify = false ;          // no stack effect checks
+      } else if (arg == "-fusions") {
+         opts.m_fusionReport = true ;     // report what it did
+      } else if (arg == "-profile") {
+         opts.m_profile = true ;          // count and time every word
+      } else if (arg == "-cache") {
+         opts.m_imageCache = true ;       // keep file.sallyc images
+      } else if (arg == "-jit") {
+         opts.m_jit = true ;              // hot loops to native code
+      } else if (arg.compare(0, 5, "-jit=") == 0) {
+         opts.m_jit = true ;
+         opts.m_jitThreshold = atoi(arg.c_str() + 5) ;
+      } else if (arg == "-jitcheck") {
+         jitcheck = true ;                // JIT against interpreter
+      } else if (arg == "-trace") {
+         opts.m_trace = 16 ;              // last words run, on errors
+      } else if (arg.compare(0, 7, "-trace=") == 0) {
+         opts.m_trace = atoi(arg.c_str() + 7) ;
+      } else if (arg == "-flush=line") {
+         opts.m_flushPolicy = OutputSink::FLUSH_EACH_LINE ;
+      } else if (arg == "-flush=full") {
+         opts.m_flushPolicy = OutputSink::FLUSH_WHEN_FULL ;
+      } else if (arg == "-flush=exit") {
+         opts.m_flushPolicy = OutputSink::FLUSH_AT_EXIT ;
+      } else if (arg.compare(0, 8, "-buffer=") == 0) {
+         opts.m_outputBuffer = atoi(arg.c_str() + 8) ;
+      } else if (arg == "-batch") {
+         batch = true ;                   // run all the files given
+      } else if (arg.compare(0, 6, "-jobs=") == 0) {
+         nthreads = atoi(arg.c_str() + 6) ;
+      } else if (arg[0] != '-') {
+         files.push_back(argv[i]) ;
+      } else {
+         return usage(argv[0]) ;
+      }
+   }
+
+   // options and files may come in any order; only -batch
+   // and -jitcheck take more than one file
+   //
+   if ( files.size() > 1 && !batch && !jitcheck ) {
+      return usage(argv[0]) ;
+   }
+
+   if ( jitcheck ) {
+      return jitCheck(files, opts) ;
+   }
+   if ( batch ) {
+      return runBatch(files, opts, nthreads > 0 ? nthreads : 1) ;
+   }
+
+   Sally S(cin, cout, opts) ;
+
+   if ( !files.empty() && !S.loadFile(files[0]) ) {
+      cerr << "Can't read " << files[0] << "\n" ;
+      return 1 ;
+   }
 
    S.mainLoop() ;
 